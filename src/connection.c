@@ -1,6 +1,17 @@
 /*
  * Connection handling
  *
+ * The connections are kept in a hash table indexed by the remote address,
+ * with open addressing and linear probing. Lookups and iteration don't take
+ * any lock: the table and the connections are freed through epoch based
+ * reclamation. Writers are serialized by connection_table_lock, insert in
+ * place and delete by leaving a tombstone. When full of tombstones or live
+ * entries, the table is rebuilt and the new one published.
+ *
+ * For broadcasts, a snapshot of all connections is republished whenever the
+ * table changes. It owns a reference on each connection, dropped once the
+ * snapshot is replaced and no reader can see it anymore.
+ *
  * Written by Daniel Ritz
  */
 
@@ -10,50 +21,247 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <errno.h>
 
+#include "lib/net.h"
+#include "lib/epoch.h"
+
 #include "connection.h"
+#include "metrics.h"
+
+/** minimum number of slots of the connection table, a power of two */
+#define CONNECTION_TABLE_MIN	16
+
+/** marks a deleted slot, probing continues past it */
+#define CONNECTION_TOMBSTONE	((connection_t *) 1)
+
+/** the connection table */
+struct connection_table {
+	epoch_entry_t epoch_entry;
+	unsigned int mask;
+	unsigned int count;		// live entries
+	unsigned int used;		// live entries and tombstones
+	connection_t *slots[];
+};
 
-static LIST_HEAD(connection_list);
-static int connection_list_size;
-pthread_mutex_t connection_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct connection_table *connection_table;
+static connection_snapshot_t *connection_snapshot;
+static pthread_mutex_t connection_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned int connection_cork_usec;
 
 int connection_ok(connection_t *conn)
 {
-	int ret;
 	if (!conn)
 		return 0;
 
-	pthread_mutex_lock(&conn->lock);
-	ret = conn->state == active;
-	pthread_mutex_unlock(&conn->lock);
-	return ret;
+	// pairs with the store in connection_connect(): the FD is valid
+	return atomic_load_acquire(&conn->state) == active;
+}
+
+static inline unsigned int table_hash(struct sockaddr_in *addr)
+{
+	return hash_64(((uint64_t) addr->sin_addr.s_addr << 16) | addr->sin_port);
+}
+
+static inline int table_slot_used(connection_t *conn)
+{
+	return conn != NULL && conn != CONNECTION_TOMBSTONE;
+}
+
+/* finds a connection by address, lock free within an epoch read section */
+static connection_t *table_find(struct connection_table *t, struct sockaddr_in *addr)
+{
+	connection_t *conn;
+	unsigned int i;
+
+	if (!t)
+		return NULL;
+
+	for (i = table_hash(addr) & t->mask; ; i = (i + 1) & t->mask) {
+		conn = atomic_load_acquire(&t->slots[i]);
+		if (!conn)
+			return NULL;
+		if (conn != CONNECTION_TOMBSTONE &&
+			conn->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+			conn->addr.sin_port == addr->sin_port)
+			return conn;
+	}
+}
+
+/* stores a connection in the first free slot, connection_table_lock held */
+static void table_store(struct connection_table *t, connection_t *conn)
+{
+	unsigned int i;
+
+	for (i = table_hash(&conn->addr) & t->mask; ; i = (i + 1) & t->mask) {
+		if (!table_slot_used(t->slots[i]))
+			break;
+	}
+
+	if (!t->slots[i])
+		t->used++;
+	t->count++;
+	atomic_store_release(&t->slots[i], conn);
+}
+
+static void table_free(epoch_entry_t *entry)
+{
+	free(container_of(entry, struct connection_table, epoch_entry));
+}
+
+/* adds a connection, rebuilding the table if needed, connection_table_lock held */
+static int table_add(connection_t *conn)
+{
+	struct connection_table *t = connection_table, *newt;
+	unsigned int size;
+
+	// keep at least a quarter of the slots empty, probing stops there
+	if (t && (t->used + 1) * 4 <= (t->mask + 1) * 3) {
+		table_store(t, conn);
+		return 0;
+	}
+
+	// new table half full after adding
+	for (size = CONNECTION_TABLE_MIN; t && size < (t->count + 1) * 2; size *= 2)
+		;
+	newt = calloc(1, sizeof(*newt) + size * sizeof(connection_t *));
+	if (!newt)
+		return -ENOMEM;
+	newt->mask = size - 1;
+
+	if (t) {
+		for (unsigned int i = 0; i <= t->mask; i++) {
+			if (table_slot_used(t->slots[i]))
+				table_store(newt, t->slots[i]);
+		}
+	}
+	table_store(newt, conn);
+
+	atomic_store_release(&connection_table, newt);
+	if (t)
+		epoch_retire(&t->epoch_entry, table_free);
+
+	return 0;
+}
+
+/* removes a connection, connection_table_lock held */
+static void table_remove(connection_t *conn)
+{
+	struct connection_table *t = connection_table;
+	unsigned int i;
+
+	for (i = table_hash(&conn->addr) & t->mask; t->slots[i]; i = (i + 1) & t->mask) {
+		if (t->slots[i] == conn) {
+			atomic_store_release(&t->slots[i], CONNECTION_TOMBSTONE);
+			t->count--;
+			return;
+		}
+	}
+}
+
+static void snapshot_free(epoch_entry_t *entry)
+{
+	connection_snapshot_t *snap = container_of(entry, connection_snapshot_t, epoch_entry);
+
+	for (unsigned int i = 0; i < snap->count; i++)
+		connection_release(snap->conns[i]);
+	free(snap);
+}
+
+/* publishes a new snapshot of the table, connection_table_lock held */
+static void snapshot_publish()
+{
+	struct connection_table *t = connection_table;
+	connection_snapshot_t *old = connection_snapshot, *snap;
+
+	snap = malloc(sizeof(*snap) + t->count * sizeof(connection_t *));
+	if (!snap) {
+		// keeps sending to the old set, sends to closed connections just fail
+		dbg("Cannot allocate connection snapshot\n");
+		return;
+	}
+
+	snap->version = old ? old->version + 1 : 1;
+	snap->count = 0;
+	for (unsigned int i = 0; i <= t->mask; i++) {
+		if (table_slot_used(t->slots[i])) {
+			connection_own(t->slots[i]);
+			snap->conns[snap->count++] = t->slots[i];
+		}
+	}
+
+	atomic_store_release(&connection_snapshot, snap);
+	if (old)
+		epoch_retire(&old->epoch_entry, snapshot_free);
 }
 
 static connection_t *create_unconnected(struct sockaddr_in *addr)
 {
-	connection_t *conn = calloc(1, sizeof(connection_t));
-	if (!conn)
+	connection_t *conn;
+
+	// the output queue has cache line aligned members
+	if (posix_memalign((void **) &conn, CACHELINE_SIZE, sizeof(connection_t)))
 		return NULL;
+	memset(conn, 0, sizeof(connection_t));
+
+	if (ring_init(&conn->outq, CONNECTION_OUTQ_SIZE, sizeof(packet_t *))) {
+		free(conn);
+		return NULL;
+	}
+	waitq_init(&conn->outq_wait);
+
+	conn->rx_version = 1;
+	conn->tx_version = 1;
+	conn->peer_max_payload = PACKET_CONTENT_SIZE;
 
 	memcpy(&conn->addr, addr, sizeof(struct sockaddr_in));
-	conn->refs = 2; // caller, connection list
+	conn->refs = 2; // caller, connection table
 	conn->fd = -1;
 
 	pthread_mutex_init(&conn->lock, NULL);
 	pthread_mutex_init(&conn->sendlock, NULL);
 
-	list_add(&conn->list_entry, &connection_list);
-	connection_list_size++;
+	// visible to lock free readers from here on
+	if (table_add(conn)) {
+		pthread_mutex_destroy(&conn->sendlock);
+		pthread_mutex_destroy(&conn->lock);
+		ring_destroy(&conn->outq);
+		free(conn);
+		return NULL;
+	}
 
 	return conn;
 }
 
+static void set_active(connection_t *conn, int fd)
+{
+	pthread_mutex_lock(&conn->lock);
+	conn->fd = fd;
+	atomic_store_release(&conn->state, active);
+	pthread_mutex_unlock(&conn->lock);
+}
+
 void connection_connect(connection_t *conn, int fd)
+{
+	packet_t *offer;
+
+	set_active(conn, fd);
+
+	// the connecting side offers version 2, ignored by old nodes
+	offer = packet_cre_version(0);
+	if (offer) {
+		connection_send_packet(conn, offer);
+		packet_put(offer);
+	}
+}
+
+void connection_connecting(connection_t *conn, int fd)
 {
 	pthread_mutex_lock(&conn->lock);
-	conn->state = active;
 	conn->fd = fd;
+	atomic_store_release(&conn->state, connecting);
 	pthread_mutex_unlock(&conn->lock);
 }
 
@@ -61,32 +269,36 @@ connection_t *connection_create(int fd, struct sockaddr_in *addr)
 {
 	connection_t *conn = NULL;
 
-	pthread_mutex_lock(&connection_list_lock);
+	pthread_mutex_lock(&connection_table_lock);
 	conn = create_unconnected(addr);
-	if (conn)
-		connection_connect(conn, fd);
-	pthread_mutex_unlock(&connection_list_lock);
+	if (conn) {
+		set_active(conn, fd);
+		snapshot_publish();
+	}
+	pthread_mutex_unlock(&connection_table_lock);
 
 	return conn;
 }
 
 connection_t *connection_create_unless_exists(struct sockaddr_in *addr)
 {
-	int found = 0;
 	connection_t *conn = NULL;
+	int found;
 
-	pthread_mutex_lock(&connection_list_lock);
-	list_for_each_entry(conn, &connection_list, list_entry) {
-		if (conn->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
-			conn->addr.sin_port == addr->sin_port)
-		{
-			found = 1;
-			break;
-		}
-	}
-	if (!found)
+	// usually the neighbor is known already: check without the lock
+	epoch_enter();
+	found = table_find(atomic_load_acquire(&connection_table), addr) != NULL;
+	epoch_exit();
+	if (found)
+		return NULL;
+
+	pthread_mutex_lock(&connection_table_lock);
+	if (!table_find(connection_table, addr)) {
 		conn = create_unconnected(addr);
-	pthread_mutex_unlock(&connection_list_lock);
+		if (conn)
+			snapshot_publish();
+	}
+	pthread_mutex_unlock(&connection_table_lock);
 
 	return conn;
 }
@@ -95,90 +307,250 @@ void connection_close(connection_t *conn)
 {
 	pthread_mutex_lock(&conn->lock);
 
-	// remove from list
-	pthread_mutex_lock(&connection_list_lock);
-	list_remove(&conn->list_entry);
-	connection_list_size--;
-	pthread_mutex_unlock(&connection_list_lock);
-	conn->refs--;
+	if (conn->state == closed) {
+		pthread_mutex_unlock(&conn->lock);
+		return;
+	}
 
-	// shutdown and close socket
-	if (conn->state == active) {
-		pthread_mutex_lock(&conn->sendlock);
+	// shutdown and close socket. shutdown() first to unblock a pending write()
+	if (conn->state == active || conn->state == connecting) {
 		shutdown(conn->fd, SHUT_RDWR);
-		close(conn->fd);
-		conn->fd = -1;
-		conn->state = closed;
-		pthread_mutex_unlock(&conn->sendlock);
+		if (!conn->io_closes_fd) {
+			pthread_mutex_lock(&conn->sendlock);
+			close(conn->fd);
+			conn->fd = -1;
+			pthread_mutex_unlock(&conn->sendlock);
+		}
 	}
+	atomic_store_release(&conn->state, closed);
 
 	pthread_mutex_unlock(&conn->lock);
+
+	// let a waiting writer thread terminate
+	waitq_wake(&conn->outq_wait, 1);
+
+	// remove from the table, drop its reference
+	pthread_mutex_lock(&connection_table_lock);
+	table_remove(conn);
+	snapshot_publish();
+	pthread_mutex_unlock(&connection_table_lock);
+	connection_release(conn);
 }
 
 void connection_own(connection_t *conn)
 {
-	pthread_mutex_lock(&conn->lock);
-	conn->refs++;
-	pthread_mutex_unlock(&conn->lock);
+	// the caller already has a reference, nothing to order
+	atomic_inc_relaxed(&conn->refs);
+}
+
+static void connection_free(epoch_entry_t *entry)
+{
+	connection_t *conn = container_of(entry, connection_t, epoch_entry);
+
+	pthread_mutex_destroy(&conn->sendlock);
+	pthread_mutex_destroy(&conn->lock);
+	free(conn);
 }
 
 void connection_release(connection_t *conn)
 {
-	unsigned int refs;
-	pthread_mutex_lock(&conn->lock);
-	refs = --(conn->refs);
-	pthread_mutex_unlock(&conn->lock);
+	if (atomic_dec_return_release(&conn->refs) == 0) {
+		// see everything done through the other references
+		smp_acquire();
 
-	if (refs == 0) {
-		pthread_mutex_destroy(&conn->sendlock);
-		pthread_mutex_destroy(&conn->lock);
-		free(conn);
+		packet_t *packet;
+		while (!ring_pop(&conn->outq, &packet))
+			packet_put(packet);
+		for (unsigned int i = 0; i < conn->txcount; i++)
+			packet_put(conn->txframes[i].pkt);
+		packet_put(conn->rxpkt);
+		ring_destroy(&conn->outq);
+
+		// lock free readers of the table may still look at it
+		epoch_retire(&conn->epoch_entry, connection_free);
+	}
+}
+
+int connection_send_packet(connection_t *conn, packet_t *packet)
+{
+	void (*kick)(connection_t *conn);
+
+	// never queue in unconnected state, there's no one to write it
+	if (!connection_ok(conn))
+		return -ENOTCONN;
+
+	packet_get(packet);
+	if (ring_push(&conn->outq, &packet)) {
+		packet_put(packet);
+		return -ENOBUFS;
 	}
+
+	kick = atomic_load_acquire(&conn->kick);
+	if (kick)
+		kick(conn);
+	else
+		waitq_wake(&conn->outq_wait, 0);
+
+	return 0;
 }
 
-ssize_t connection_send_packet(connection_t *conn, packet_t *packet)
+/* sets up the frame of a packet for the current version, false if the peer can't take it */
+static int tx_frame(connection_t *conn, struct connection_txframe *frame, packet_t *packet)
 {
-	ssize_t len = 0;
+	frame->pkt = packet;
+
+	if (conn->tx_version < 2) {
+		if (!packet_v1_compatible(packet))
+			return 0;
+		frame->hdrlen = 0;
+		frame->len = PACKET_SIZE;
+	} else {
+		if (packet_get_len(packet) > atomic_load_relaxed(&conn->peer_max_payload))
+			return 0;
+		frame->hdrlen = packet_v2_header(packet, frame->hdr);
+		frame->len = frame->hdrlen + packet_get_len(packet);
+	}
+
+	// the frames after the switch are version 2
+	if (packet_get_type(packet) == 'V' && (packet->packet.content[1] & PACKET_VERSION_SWITCH))
+		conn->tx_version = 2;
+
+	return 1;
+}
+
+/* adds a buffer to the iovecs, skipping the part already written */
+static inline unsigned int tx_iov_add(struct iovec *iov, unsigned int num, char *base,
+	size_t len, size_t *skip)
+{
+	if (*skip >= len) {
+		*skip -= len;
+		return num;
+	}
+
+	iov[num].iov_base = base + *skip;
+	iov[num].iov_len = len - *skip;
+	*skip = 0;
+	return num + 1;
+}
+
+unsigned int connection_tx_prepare(connection_t *conn, struct iovec *iov)
+{
+	struct connection_txframe *frame;
+	unsigned int max, num = 0;
+	size_t skip = conn->txoff;
+	packet_t *packet;
+	char hoststr[INET_ADDRSTRLEN];
+
+	// fill up the batch from the queue
+	max = CONNECTION_TX_IOVS < IOV_MAX ? CONNECTION_TX_BATCH : IOV_MAX / 2;
+	while (conn->txcount < max && !ring_pop(&conn->outq, &packet)) {
+		if (tx_frame(conn, &conn->txframes[conn->txcount], packet)) {
+			conn->txcount++;
+		} else {
+			metrics_inc(METRIC_SEND_FAILURES);
+			dbg("Dropping packet too large for %s:%hu\n",
+				net_addr_str(connection_get_addr(conn), hoststr, sizeof(hoststr)),
+				connection_get_port(conn));
+			packet_put(packet);
+		}
+	}
+
+	for (unsigned int i = 0; i < conn->txcount; i++) {
+		frame = &conn->txframes[i];
+		if (!frame->hdrlen) {
+			num = tx_iov_add(iov, num, frame->pkt->raw, PACKET_SIZE, &skip);
+		} else {
+			num = tx_iov_add(iov, num, frame->hdr, frame->hdrlen, &skip);
+			if (frame->len > frame->hdrlen)
+				num = tx_iov_add(iov, num, packet_get_payload(frame->pkt),
+					frame->len - frame->hdrlen, &skip);
+		}
+	}
+
+	return num;
+}
+
+void connection_tx_done(connection_t *conn, size_t len)
+{
+	unsigned int done = 0;
+
+	metrics_add(METRIC_BYTES_SENT, len);
+
+	// release the packets written completely, keep the rest in order
+	len += conn->txoff;
+	while (done < conn->txcount && len >= conn->txframes[done].len) {
+		len -= conn->txframes[done].len;
+		packet_put(conn->txframes[done].pkt);
+		done++;
+	}
+	conn->txoff = len;
+	conn->txcount -= done;
+	metrics_add(METRIC_PACKETS_SENT, done);
+	atomic_store_relaxed(&conn->tx_packets, conn->tx_packets + done);
+	memmove(&conn->txframes[0], &conn->txframes[done],
+		conn->txcount * sizeof(struct connection_txframe));
+}
+
+int connection_flush(connection_t *conn)
+{
+	struct iovec iov[CONNECTION_TX_IOVS];
+	unsigned int num;
+	ssize_t len;
+	int err = 0;
 
 	/*
-	 * This seems racy - conn->state can change between conn->lock and conn->sendlock
-	 * But it's safe:
-	 * - if a connection is not yet active but becomes active during the "race",
-	 *   we just fail to send - as we would if there was no race
-	 * - if a connection is active but becomes inactive during the "race", the FD
-	 *   stays around (updating it is locked with conn->sendlock) and write() will just file
-	 * The only point is never to write() in unconnected state where there's no valid FD
+	 * Only the I/O layer owning the connection calls this, so there's only
+	 * one thread touching the tx batch. The sendlock just makes sure the FD
+	 * isn't closed while writing.
 	 */
-	pthread_mutex_lock(&conn->lock);
-	if (conn->state != active) {
-		pthread_mutex_unlock(&conn->lock);
-		return 0;
+	pthread_mutex_lock(&conn->sendlock);
+	if (conn->fd == -1) {
+		pthread_mutex_unlock(&conn->sendlock);
+		return -ENOTCONN;
 	}
-	pthread_mutex_unlock(&conn->lock);
 
-	pthread_mutex_lock(&conn->sendlock);
-	do {
-		len = write(connection_get_fd(conn), packet, PACKET_SIZE);
-	} while (len < 0 && errno == EINTR);
+	for (;;) {
+		num = connection_tx_prepare(conn, iov);
+		if (!num)
+			break;
+
+		len = writev(conn->fd, iov, num);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			err = errno == EWOULDBLOCK ? -EAGAIN : -errno;
+			break;
+		}
+
+		connection_tx_done(conn, len);
+	}
 	pthread_mutex_unlock(&conn->sendlock);
 
-	return len;
+	return err;
 }
 
-connection_t **connection_get_array()
+void connection_set_cork(unsigned int usec)
 {
-	connection_t **array, **iter, *conn;
+	connection_cork_usec = usec;
+}
 
-	pthread_mutex_lock(&connection_list_lock);
-	array = calloc(connection_list_size + 1, sizeof(connection_t *));
-	if (array) {
-		iter = array;
-		list_for_each_entry(conn, &connection_list, list_entry) {
-			connection_own(conn);
-			*iter = conn;
-			iter++;
-		}
-	}
-	pthread_mutex_unlock(&connection_list_lock);
-	return array;
+void connection_set_io(connection_t *conn, void (*kick)(connection_t *conn), void *priv)
+{
+	conn->io_priv = priv;
+	atomic_store_release(&conn->kick, kick);
+}
+
+connection_snapshot_t *connection_snapshot_get()
+{
+	connection_snapshot_t *snap;
+	static connection_snapshot_t empty;
+
+	epoch_enter();
+	snap = atomic_load_acquire(&connection_snapshot);
+	return snap ? snap : &empty;
+}
+
+void connection_snapshot_put(connection_snapshot_t *snap)
+{
+	epoch_exit();
 }
@@ -2,9 +2,15 @@
 #define CONNECTION_H
 
 #include <pthread.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
 #include "lib/list.h"
+#include "lib/ring.h"
+#include "lib/waitq.h"
+#include "lib/utils.h"
+#include "lib/epoch.h"
+#include "lib/hist.h"
 
 #include "packet.h"
 
@@ -12,11 +18,29 @@
  * Definition of connection API. A connection is a socket FD and additional status
  */
 
+/** number of packets queued for sending per connection, a power of two */
+#define CONNECTION_OUTQ_SIZE	1024
+
+/** max. number of packets written by one writev(), bounded by IOV_MAX */
+#define CONNECTION_TX_BATCH		256
+
+/** number of iovecs for a batch: header and payload per packet */
+#define CONNECTION_TX_IOVS		(2 * CONNECTION_TX_BATCH)
+
 /** state of a connection */
 enum connection_state {
 	unconnected = 0,
 	active = 1,
 	closed = 2,
+	connecting = 3,
+};
+
+/** a packet in the batch being written, as frame of the current version */
+struct connection_txframe {
+	packet_t *pkt;
+	unsigned int len;
+	unsigned int hdrlen;
+	char hdr[PACKET_V2_HDR_SIZE];
 };
 
 /** one connection */
@@ -24,13 +48,73 @@ typedef struct connection {
 	int fd;
 	struct sockaddr_in addr;
 
+	// state and refs are atomic, lock only serializes the state transitions
+	// in connection_connect() and connection_close()
 	enum connection_state state;
 	pthread_mutex_t lock;
 	pthread_mutex_t sendlock;
 	unsigned int refs;
-	list_head_t list_entry;
+	epoch_entry_t epoch_entry;
+
+	// protocol version per direction, see packet.h. The peer's max. payload
+	// is set when it announced version 2
+	unsigned char rx_version;
+	unsigned char tx_version;
+	int tx_switch_queued;
+	unsigned int peer_max_payload;
+
+	// receive side: the partially received packet (for version 2: the
+	// payload, after the header in rxhdr)
+	packet_t *rxpkt;
+	size_t rxlen;
+	char rxhdr[PACKET_V2_HDR_MAX];
+	size_t rxhdrlen;
+
+	// send side: queued packets and the batch being written, the first one
+	// possibly partially. Written by one thread only: the writer thread or
+	// the event loop
+	ring_t outq;
+	struct connection_txframe txframes[CONNECTION_TX_BATCH];
+	unsigned int txcount;
+	size_t txoff;
+
+	// the I/O layer: called when packets were queued, NULL for the writer
+	// thread waiting on outq_wait
+	void (*kick)(struct connection *conn);
+	void *io_priv;
+
+	// the I/O layer closes the socket itself once no queued operation
+	// refers to its number anymore, connection_close() only shuts it down
+	int io_closes_fd;
+	waitq_t outq_wait;
+	list_head_t kick_entry;
+	int kick_pending;
+	ustime_t kick_time;
+
+	// counters for the metrics, rx written by the receiving side, tx by the
+	// I/O layer writing
+	unsigned long rx_packets;
+	unsigned long tx_packets;
+
+	// RTTs of the acks received through the connection, written by the
+	// routing under its lock
+	hist_t latency;
 } connection_t;
 
+/** an immutable snapshot of all connections, replaced on every change */
+typedef struct connection_snapshot {
+	epoch_entry_t epoch_entry;
+	unsigned long version;
+	unsigned int count;
+	connection_t *conns[];
+} connection_snapshot_t;
+
+/**
+ * the corking window in microseconds: how long the I/O layer may wait for
+ * more packets to write them at once. 0 to write immediately
+ */
+extern unsigned int connection_cork_usec;
+
 /**
  * returns the FD associated with a connection
  * @param conn the connection
@@ -68,25 +152,75 @@ static inline unsigned short connection_get_port(connection_t *conn)
  */
 static inline int connection_unconnected(connection_t *conn)
 {
-	return conn->state == unconnected;
+	return atomic_load_relaxed(&conn->state) == unconnected;
+}
+
+/**
+ * checks if a connection is closed, lock free
+ * @param conn the connection
+ * @return true value if the connection state is closed
+ */
+static inline int connection_is_closed(connection_t *conn)
+{
+	return atomic_load_acquire(&conn->state) == closed;
+}
+
+/**
+ * checks if there are packets waiting to be written to the socket
+ * @param conn the connection
+ * @return true value if there are packets queued
+ */
+static inline int connection_has_output(connection_t *conn)
+{
+	return conn->txcount > 0 || ring_count(&conn->outq) > 0;
+}
+
+/**
+ * returns the number of packets waiting to be written to the socket. Only
+ * a snapshot, exact only for the I/O layer owning the connection.
+ * @param conn the connection
+ * @return number of packets queued
+ */
+static inline unsigned int connection_output_count(connection_t *conn)
+{
+	return conn->txcount + ring_count(&conn->outq);
 }
 
 /**
- * checks if a connection is OK (active)
+ * checks if a connection is OK (active), lock free
  * @param conn the connection
  * @return true value if connection is active
  */
 int connection_ok(connection_t *conn);
 
 /**
- * bind an FD to an unconnected connection
+ * bind an FD to an unconnected connection, offers protocol version 2 to the peer
  * @param conn the connection
  * @param fd the file descriptor
  */
 void connection_connect(connection_t *conn, int fd);
 
 /**
- * creates a connection from an fd and adds it to the connection list
+ * bind an FD with a non-blocking connect() in progress to an unconnected
+ * connection. connection_connect() must be called once connected.
+ * @param conn the connection
+ * @param fd the file descriptor
+ */
+void connection_connecting(connection_t *conn, int fd);
+
+/**
+ * checks if a connection has a connect() in progress, lock free (only the
+ * thread doing the connect() changes the state)
+ * @param conn the connection
+ * @return true value if the connection state is connecting
+ */
+static inline int connection_is_connecting(connection_t *conn)
+{
+	return atomic_load_acquire(&conn->state) == connecting;
+}
+
+/**
+ * creates a connection from an fd and adds it to the connection table
  * @param fd the socket fd
  * @param addr address of the connection
  * @return connection
@@ -104,7 +238,8 @@ connection_t *connection_create_unless_exists(struct sockaddr_in *addr);
 
 /**
  * closes a connection and removes it from the table. The caller also
- * has to call connection_release() to release ownership.
+ * has to call connection_release() to release ownership. Closing an already
+ * closed connection does nothing.
  * @param conn the connection
  */
 void connection_close(connection_t *conn);
@@ -123,18 +258,72 @@ void connection_own(connection_t *conn);
 void connection_release(connection_t *conn);
 
 /**
- * sends a packet, locking the connection before sending
+ * queues a packet for sending, never blocks. The connection takes a reference
+ * on the packet, the I/O layer is notified to write it to the socket.
  * @param conn the connection
  * @param packet the packet to send
- * @return the number of bytes actually sent or -1 on error
+ * @return 0 if queued, -ENOTCONN if not connected, -ENOBUFS if the queue of the
+ * connection is full (packet dropped)
+ */
+int connection_send_packet(connection_t *conn, packet_t *packet);
+
+/**
+ * writes queued packets to the socket until the queue is empty or the socket
+ * would block, up to CONNECTION_TX_BATCH packets per writev(). Packets are
+ * written as frames of the version negotiated, packets the peer can't take
+ * are dropped. Must only be
+ * called by the I/O layer owning the connection.
+ * @param conn the connection
+ * @return 0 if all written, -EAGAIN if the socket would block, other error
+ * code (negative) on error
+ */
+int connection_flush(connection_t *conn);
+
+/**
+ * prepares the next batch of queued packets for writing: fills the batch
+ * from the queue. For I/O layers doing the write themselves, like
+ * connection_flush() does.
+ * @param conn the connection
+ * @param iov array of CONNECTION_TX_IOVS iovecs receiving the buffers
+ * @return the number of iovecs filled, 0 if nothing to write
+ */
+unsigned int connection_tx_prepare(connection_t *conn, struct iovec *iov);
+
+/**
+ * completes a write of a batch prepared by connection_tx_prepare(), the
+ * packets written completely are released
+ * @param conn the connection
+ * @param len the number of bytes written
+ */
+void connection_tx_done(connection_t *conn, size_t len);
+
+/**
+ * sets the corking window
+ * @param usec the window in microseconds, 0 to disable
+ */
+void connection_set_cork(unsigned int usec);
+
+/**
+ * sets the I/O layer notified when packets are queued. Without, a thread
+ * waiting on conn->outq_wait is woken up.
+ * @param conn the connection
+ * @param kick the function called when packets are queued
+ * @param priv private data of the I/O layer
+ */
+void connection_set_io(connection_t *conn, void (*kick)(connection_t *conn), void *priv);
+
+/**
+ * gets the current snapshot of all connections, lock free. The connections
+ * in it can be used without owning them until the snapshot is put back.
+ * Don't block while holding a snapshot, it delays freeing memory.
+ * @return the snapshot, never NULL
  */
-ssize_t connection_send_packet(connection_t *conn, packet_t *packet);
+connection_snapshot_t *connection_snapshot_get();
 
 /**
- * gets all current connections as an array (NULL-terminated)
- * return value must be free()d
- * @return array of current connections
+ * puts back a snapshot obtained with connection_snapshot_get()
+ * @param snap the snapshot
  */
-connection_t **connection_get_array();
+void connection_snapshot_put(connection_snapshot_t *snap);
 
 #endif
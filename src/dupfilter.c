@@ -0,0 +1,152 @@
+/**
+ * Duplicate packet filter
+ *
+ * Time is divided into epochs of a third of the window. For each of the last
+ * DUPFILTER_EPOCHS epochs there's a bloom filter over the destination and
+ * the full packet ID, sized for the packets of one epoch at the configured
+ * rate. A packet is a duplicate if all its bits are set in the current or
+ * one of the previous epochs. When a new epoch starts, the bitmap of the
+ * oldest one is cleared and reused, so memory is bounded by the rate and
+ * the cost per packet is constant. IDs wrapping around don't matter as
+ * long as they don't come back within the window.
+ *
+ * Bits are set with atomic operations. Only starting a new epoch is locked,
+ * which happens once per epoch. Two threads checking the same packet at the
+ * same time may both take it for new, the copy is dropped a hop later.
+ *
+ * Written by agent
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include "lib/utils.h"
+#include "lib/atomic.h"
+
+#include "dupfilter.h"
+
+/** number of epochs remembered, including the current one */
+#define DUPFILTER_EPOCHS	4
+
+/** bits per packet and bits set per packet: 1e-6 false positives per epoch */
+#define DUPFILTER_PACKET_BITS	64
+#define DUPFILTER_HASHES		6
+
+#define BITS_PER_WORD		(8 * sizeof(unsigned long))
+
+struct dupfilter_epoch {
+	unsigned long number;
+	unsigned long *bitmap;
+};
+
+static struct dupfilter_epoch epochs[DUPFILTER_EPOCHS];
+static unsigned long current_epoch;
+static unsigned int epoch_ms;
+static unsigned long bitmap_words;
+static pthread_mutex_t rotate_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int dupfilter_initialize(unsigned int window_ms, unsigned int rate)
+{
+	unsigned long packets, bits;
+
+	if (window_ms < DUPFILTER_EPOCHS - 1 || !rate)
+		return -EINVAL;
+
+	epoch_ms = window_ms / (DUPFILTER_EPOCHS - 1);
+
+	// a power of two, the bit index is masked
+	packets = (unsigned long long) rate * epoch_ms / 1000 + 1;
+	for (bits = BITS_PER_WORD; bits < packets * DUPFILTER_PACKET_BITS; bits <<= 1)
+		;
+	bitmap_words = bits / BITS_PER_WORD;
+
+	for (unsigned int i = 0; i < DUPFILTER_EPOCHS; i++) {
+		epochs[i].bitmap = calloc(bitmap_words, sizeof(unsigned long));
+		if (!epochs[i].bitmap)
+			return -ENOMEM;
+	}
+
+	current_epoch = time_monotonic_us() / 1000 / epoch_ms;
+	for (unsigned long n = current_epoch - DUPFILTER_EPOCHS + 1; n <= current_epoch; n++)
+		epochs[n % DUPFILTER_EPOCHS].number = n;
+
+	return 0;
+}
+
+/* starts epoch number 'now', clearing the bitmaps it reuses */
+static void dupfilter_rotate(unsigned long now)
+{
+	unsigned long first;
+	struct dupfilter_epoch *epoch;
+
+	pthread_mutex_lock(&rotate_lock);
+
+	// skipped epochs were empty anyway
+	first = current_epoch + 1;
+	if (now - first >= DUPFILTER_EPOCHS)
+		first = now - DUPFILTER_EPOCHS + 1;
+
+	for (unsigned long n = first; n <= now && n > current_epoch; n++) {
+		epoch = &epochs[n % DUPFILTER_EPOCHS];
+		atomic_store_relaxed(&epoch->number, n);
+		memset(epoch->bitmap, 0, bitmap_words * sizeof(unsigned long));
+	}
+
+	// cleared before anyone sets bits in it
+	if (now > current_epoch)
+		atomic_store_release(&current_epoch, now);
+
+	pthread_mutex_unlock(&rotate_lock);
+}
+
+int dupfilter_check(packet_dest_t dest, packet_id_t id)
+{
+	unsigned long now = time_monotonic_us() / 1000 / epoch_ms;
+	unsigned long cur = atomic_load_acquire(&current_epoch);
+	unsigned long mask = bitmap_words * BITS_PER_WORD - 1;
+	unsigned long bitno[DUPFILTER_HASHES];
+	uint64_t h1, h2;
+	struct dupfilter_epoch *epoch;
+	unsigned long set, old;
+
+	if (now > cur) {
+		dupfilter_rotate(now);
+		cur = now;
+	}
+
+	// bit i at h1 + i * h2, h2 odd to hit distinct bits
+	h1 = hash_64(id ^ hash_64(dest));
+	h2 = hash_64(h1) | 1;
+	for (unsigned int i = 0; i < DUPFILTER_HASHES; i++)
+		bitno[i] = (h1 + i * h2) & mask;
+
+	// previous epochs: only read
+	for (unsigned long n = cur - DUPFILTER_EPOCHS + 1; n != cur; n++) {
+		epoch = &epochs[n % DUPFILTER_EPOCHS];
+		if (atomic_load_relaxed(&epoch->number) != n)
+			continue;
+
+		set = 0;
+		for (unsigned int i = 0; i < DUPFILTER_HASHES; i++) {
+			if (!(atomic_load_relaxed(&epoch->bitmap[bitno[i] / BITS_PER_WORD]) &
+				(1UL << (bitno[i] % BITS_PER_WORD))))
+				break;
+			set++;
+		}
+		if (set == DUPFILTER_HASHES)
+			return 1;
+	}
+
+	// current epoch: test and set, seen if all bits were set before
+	epoch = &epochs[cur % DUPFILTER_EPOCHS];
+	set = 0;
+	for (unsigned int i = 0; i < DUPFILTER_HASHES; i++) {
+		old = atomic_fetch_or_relaxed(&epoch->bitmap[bitno[i] / BITS_PER_WORD],
+			1UL << (bitno[i] % BITS_PER_WORD));
+		if (old & (1UL << (bitno[i] % BITS_PER_WORD)))
+			set++;
+	}
+	return set == DUPFILTER_HASHES;
+}
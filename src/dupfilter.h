@@ -0,0 +1,39 @@
+#ifndef DUPFILTER_H
+#define DUPFILTER_H
+
+/**
+ * Duplicate packet filter - remembers the packet IDs seen per destination
+ * for a time window, no matter how many packets arrive in it
+ *
+ * Written by agent
+ */
+
+#include "packet.h"
+
+/** default time window in milliseconds */
+#define DUPFILTER_DEFAULT_WINDOW	1000
+
+/** default packets per second the filter is sized for */
+#define DUPFILTER_DEFAULT_RATE		200000
+
+/**
+ * initializes the duplicate filter
+ * @param window_ms how long packet IDs are remembered at least, in
+ * milliseconds. They're forgotten after 4/3 of the window at the latest
+ * @param rate packets per second expected at most. Memory is sized for it,
+ * above the rate more fresh packets are taken for duplicates
+ * @return 0 on success, error code (negative) otherwise
+ */
+int dupfilter_initialize(unsigned int window_ms, unsigned int rate);
+
+/**
+ * checks if a packet was seen within the time window and marks it seen.
+ * Lock free, O(1). A fresh packet is taken for a duplicate with a
+ * probability of about 1e-6 at the configured rate.
+ * @param dest the destination of the packet
+ * @param id the packet ID
+ * @return true value if seen before, 0 otherwise
+ */
+int dupfilter_check(packet_dest_t dest, packet_id_t id);
+
+#endif
@@ -0,0 +1,353 @@
+/*
+ * Event loop: a fixed number of threads each running an edge triggered epoll
+ * instance. Connections are assigned round-robin to the threads on creation
+ * and stay with that thread until closed. All sockets are non-blocking.
+ *
+ * Only the owning thread writes to a connection's socket: queued packets
+ * are flushed when the socket becomes writable, or after a kick. Kicks from
+ * other threads put the connection on the loop's pending list and wake it
+ * up with an eventfd. With corking enabled, a kicked connection stays on the
+ * pending list until either a full batch is queued or the corking window is
+ * over, a timerfd wakes up the loop for the latter.
+ *
+ * Written by agent
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "lib/utils.h"
+#include "lib/net.h"
+#include "lib/atomic.h"
+
+#include "evloop.h"
+#include "receiver.h"
+
+/** max. number of events returned by one epoll_wait() */
+#define EVLOOP_MAX_EVENTS	64
+
+struct evloop {
+	int epfd;
+	int evfd;
+	int timerfd;
+	pthread_t thread;
+
+	// connections with packets queued by other threads
+	pthread_mutex_t pending_lock;
+	list_head_t pending;
+};
+
+static struct evloop *loops;
+static unsigned int num_loops;
+static unsigned int next_loop;
+
+/* epoll data of the eventfd and the timerfd */
+static char evfd_tag, timerfd_tag;
+
+/** the loop run by the current thread, if any */
+static __thread struct evloop *current_loop;
+
+static void evloop_destroy_conn(connection_t *conn)
+{
+	char hoststr[INET_ADDRSTRLEN];
+
+	// already destroyed, i.e. closed, by this thread
+	if (connection_is_closed(conn))
+		return;
+
+	dbg("Destroying connection to %s:%hu\n",
+		net_addr_str(connection_get_addr(conn), hoststr, sizeof(hoststr)),
+		connection_get_port(conn));
+
+	// close() also removes the FD from the epoll set
+	connection_close(conn);
+	connection_release(conn);
+}
+
+static int evloop_finish_connect(connection_t *conn)
+{
+	int fd = connection_get_fd(conn);
+	int err;
+	char hoststr[INET_ADDRSTRLEN];
+
+	net_addr_str(connection_get_addr(conn), hoststr, sizeof(hoststr));
+
+	err = net_connect_result(fd);
+	if (err) {
+		dbg("  Cannot connect to %s:%hu\n", hoststr, connection_get_port(conn));
+		return err;
+	}
+
+	connection_connect(conn, fd);
+	dbg("  Connected to %s:%hu\n", hoststr, connection_get_port(conn));
+	return 0;
+}
+
+static int evloop_flush(connection_t *conn)
+{
+	int err;
+
+	err = connection_flush(conn);
+	if (err == -EAGAIN || err == -ENOTCONN)
+		return 0;
+	return err;
+}
+
+static void evloop_handle(connection_t *conn, uint32_t events)
+{
+	ssize_t len;
+
+	if (connection_is_connecting(conn)) {
+		if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+			return;
+		if (evloop_finish_connect(conn))
+			goto out_close;
+	}
+
+	// socket writable again: continue writing
+	if ((events & EPOLLOUT) && evloop_flush(conn))
+		goto out_close;
+
+	if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP)))
+		return;
+
+	// edge triggered: read until the socket is drained
+	for (;;) {
+		len = receiver_read(conn);
+		if (len > 0)
+			continue;
+		if (len == -EAGAIN || len == -EWOULDBLOCK)
+			return;
+		break;
+	}
+
+out_close:
+	evloop_destroy_conn(conn);
+}
+
+static int evloop_corked(connection_t *conn, ustime_t now, ustime_t *next)
+{
+	ustime_t deadline = conn->kick_time + connection_cork_usec;
+
+	if (deadline <= now || connection_output_count(conn) >= CONNECTION_TX_BATCH)
+		return 0;
+
+	if (*next == 0 || deadline < *next)
+		*next = deadline;
+	return 1;
+}
+
+static void evloop_arm_timer(struct evloop *loop, ustime_t usec)
+{
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec = usec / 1000000,
+			.tv_nsec = (usec % 1000000) * 1000,
+		},
+	};
+
+	timerfd_settime(loop->timerfd, 0, &its, NULL);
+}
+
+static void evloop_run_pending(struct evloop *loop)
+{
+	LIST_HEAD(work);
+	connection_t *conn, *tmp;
+	ustime_t now = 0, next = 0;
+
+	// move all pending connections to the local list
+	pthread_mutex_lock(&loop->pending_lock);
+	list_splice_init(&loop->pending, &work);
+	pthread_mutex_unlock(&loop->pending_lock);
+
+	if (connection_cork_usec && !list_empty(&work))
+		now = time_monotonic_us();
+
+	list_for_each_entry_safe(conn, tmp, &work, kick_entry) {
+		// keep it on the list, still within the corking window
+		if (connection_cork_usec && evloop_corked(conn, now, &next))
+			continue;
+
+		list_remove(&conn->kick_entry);
+
+		// clear before flushing: a kick after this schedules again
+		atomic_xchg(&conn->kick_pending, 0);
+		if (evloop_flush(conn))
+			evloop_destroy_conn(conn);
+
+		// reference taken by evloop_kick()
+		connection_release(conn);
+	}
+
+	// corked connections: back to the pending list, wake up at the earliest deadline
+	if (next) {
+		pthread_mutex_lock(&loop->pending_lock);
+		list_splice_init(&work, &loop->pending);
+		pthread_mutex_unlock(&loop->pending_lock);
+		evloop_arm_timer(loop, next - now);
+	}
+}
+
+static void evloop_kick(connection_t *conn)
+{
+	struct evloop *loop = conn->io_priv;
+	uint64_t one = 1;
+	int was_empty;
+
+	// already scheduled, the flush will pick up the new packet
+	if (atomic_xchg(&conn->kick_pending, 1))
+		return;
+
+	if (connection_cork_usec)
+		conn->kick_time = time_monotonic_us();
+
+	connection_own(conn);
+	pthread_mutex_lock(&loop->pending_lock);
+	was_empty = list_empty(&loop->pending);
+	list_add_tail(&conn->kick_entry, &loop->pending);
+	pthread_mutex_unlock(&loop->pending_lock);
+
+	// the loop thread itself runs the pending list after each batch of events
+	if (was_empty && loop != current_loop) {
+		while (write(loop->evfd, &one, sizeof(one)) == -1 && errno == EINTR)
+			;
+	}
+}
+
+static void *evloop_thread(void *arg)
+{
+	struct evloop *loop = arg;
+	struct epoll_event events[EVLOOP_MAX_EVENTS];
+	uint64_t val;
+	int num;
+
+	current_loop = loop;
+
+	for (;;) {
+		num = epoll_wait(loop->epfd, events, EVLOOP_MAX_EVENTS, -1);
+		if (num == -1) {
+			if (errno == EINTR)
+				continue;
+			check_error(-errno);
+			break;
+		}
+
+		for (int i = 0; i < num; i++) {
+			// the eventfd: kicked by another thread
+			if (events[i].data.ptr == &evfd_tag) {
+				while (read(loop->evfd, &val, sizeof(val)) == -1 && errno == EINTR)
+					;
+				continue;
+			}
+			// the timerfd: corking window over
+			if (events[i].data.ptr == &timerfd_tag) {
+				while (read(loop->timerfd, &val, sizeof(val)) == -1 && errno == EINTR)
+					;
+				continue;
+			}
+			evloop_handle(events[i].data.ptr, events[i].events);
+		}
+
+		evloop_run_pending(loop);
+	}
+
+	return NULL;
+}
+
+int evloop_initialize(unsigned int num_threads)
+{
+	struct epoll_event ev;
+	int err;
+
+	if (num_threads == 0)
+		return -EINVAL;
+
+	loops = calloc(num_threads, sizeof(struct evloop));
+	if (!loops)
+		return -ENOMEM;
+
+	for (unsigned int i = 0; i < num_threads; i++) {
+		struct evloop *loop = &loops[i];
+
+		pthread_mutex_init(&loop->pending_lock, NULL);
+		INIT_LIST_HEAD(&loop->pending);
+
+		loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (loop->epfd == -1)
+			return -errno;
+
+		loop->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (loop->evfd == -1)
+			return -errno;
+
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = &evfd_tag;
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->evfd, &ev) == -1)
+			return -errno;
+
+		loop->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (loop->timerfd == -1)
+			return -errno;
+
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = &timerfd_tag;
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->timerfd, &ev) == -1)
+			return -errno;
+
+		err = pthread_create(&loop->thread, NULL, evloop_thread, loop);
+		if (err)
+			return -err;
+		pthread_detach(loop->thread);
+	}
+
+	num_loops = num_threads;
+	return 0;
+}
+
+int evloop_enabled()
+{
+	return num_loops > 0;
+}
+
+int evloop_add(connection_t *conn)
+{
+	struct evloop *loop;
+	struct epoll_event ev;
+	char hoststr[INET_ADDRSTRLEN];
+	int fd, err;
+
+	loop = &loops[atomic_fetch_add_relaxed(&next_loop, 1) % num_loops];
+
+	if (connection_unconnected(conn)) {
+		dbg("Event loop: trying to connect to %s:%hu\n",
+			net_addr_str(connection_get_addr(conn), hoststr, sizeof(hoststr)),
+			connection_get_port(conn));
+
+		fd = net_connect_nonblock(connection_get_addr(conn));
+		if (fd < 0)
+			return fd;
+		connection_connecting(conn, fd);
+
+	} else {
+		fd = connection_get_fd(conn);
+		err = net_set_nonblock(fd);
+		if (err)
+			return err;
+	}
+
+	// packets queued before this are written on the initial EPOLLOUT
+	connection_set_io(conn, evloop_kick, loop);
+
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = conn;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		return -errno;
+
+	return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+/**
+ * Event loop: edge triggered epoll based I/O core
+ *
+ * Written by agent
+ */
+
+#include <errno.h>
+
+#include "connection.h"
+
+#ifdef HAVE_EPOLL
+
+/**
+ * initializes the event loop and starts the event loop threads. Once
+ * initialized, connections are handled by the event loop instead of one
+ * receiver thread per connection.
+ * @param num_threads the number of event loop threads
+ * @return 0 on success, error code (negative) otherwise
+ */
+int evloop_initialize(unsigned int num_threads);
+
+/**
+ * checks if the event loop is used
+ * @return true value if the event loop is initialized
+ */
+int evloop_enabled();
+
+/**
+ * adds a connection to the event loop. The event loop takes over the
+ * ownership of the caller, i.e. closes and releases the connection once done.
+ * If the connection is unconnected, a non-blocking connect() is started.
+ * @param conn the connection
+ * @return 0 on success, error code (negative) otherwise
+ */
+int evloop_add(connection_t *conn);
+
+#else
+
+static inline int evloop_initialize(unsigned int num_threads)
+{
+	return -ENOSYS;
+}
+
+static inline int evloop_enabled()
+{
+	return 0;
+}
+
+static inline int evloop_add(connection_t *conn)
+{
+	return -ENOSYS;
+}
+
+#endif
+
+#endif
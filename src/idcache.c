@@ -1,9 +1,17 @@
 /**
  * Packet ID cache
  *
- * Uses a pre-alloated array of hash entries acting as a ring on writing.
- * Also uses a fixed-size hash using entry-embedded doubly linked lists to
- * provide fast lookup. The hash function used is "((id & 0xFF) * 33 + id >> 8)"
+ * The cache is split into IDCACHE_SHARDS shards, each with its own lock, so
+ * threads handling different packets rarely contend. The shard is selected
+ * by the low bits of a hash of (dest, id), the slot within the shard by
+ * the next bits.
+ *
+ * Each shard uses a pre-alloated array of entries acting as a ring on
+ * writing, indexed by a flat open addressing hash table with linear probing:
+ * a slot holds the index of an entry plus one, 0 if empty. When the write
+ * pointer overwrites an entry, its slot is deleted by shifting back the
+ * following entries of the probe sequence, so there are no tombstones and
+ * probe sequences never grow with age.
  *
  * Written by Daniel Ritz
  */
@@ -14,113 +22,199 @@
 #include <errno.h>
 
 #include "lib/utils.h"
+#include "lib/atomic.h"
 
 #include "idcache.h"
 #include "connection.h"
 
-#define PACKET_ID_CACHE_SIZE	1024
-#define PACKET_ID_HASH_BITS		   6
-
-#define HASH_ENTRIES			(1 << PACKET_ID_HASH_BITS)
-#define HASH_MASK				(HASH_ENTRIES - 1)
+/** number of shards, a power of two */
+#define IDCACHE_SHARD_BITS		   4
+#define IDCACHE_SHARDS			(1 << IDCACHE_SHARD_BITS)
+#define SHARD_MASK				(IDCACHE_SHARDS - 1)
 
 struct idcache_entry {
 	connection_t *conn;
-	list_head_t hashnode;
-	mstime_t time;
-	unsigned short id;
-	char dest;
+	packet_id_t id;
+	ustime_t time;
+	unsigned int hash;
+	packet_dest_t dest;
+	char used;
 };
 
-static pthread_mutex_t idcache_lock = PTHREAD_MUTEX_INITIALIZER;
-static struct idcache_entry *idcache;
-static list_head_t *idhash;
-static int ptr_write;
+/** one shard: ring of entries, hash slots and the lock protecting them */
+struct idcache_shard {
+	pthread_mutex_t lock;
+	struct idcache_entry *entries;
+	unsigned int *slots;
+	unsigned int slot_mask;
+	unsigned int ptr_write;
+} __cacheline_aligned;
+
+static struct idcache_shard *shards;
+static unsigned int shard_size;
 
-int idcache_initialize()
+int idcache_initialize(unsigned int size, unsigned int slots)
 {
-	idcache = calloc(PACKET_ID_CACHE_SIZE, sizeof(struct idcache_entry));
-	if (!idcache)
-		goto out_free;
+	unsigned int shard_slots;
+
+	if (!slots)
+		for (slots = IDCACHE_SHARDS; slots < 2 * size; slots *= 2)
+			;
+
+	// each shard needs free slots to terminate the probing
+	shard_size = (size + IDCACHE_SHARDS - 1) / IDCACHE_SHARDS;
+	shard_slots = slots / IDCACHE_SHARDS;
+	if (!size || (slots & (slots - 1)) || shard_slots <= shard_size)
+		return -EINVAL;
 
-	idhash = malloc(HASH_ENTRIES * sizeof(list_head_t));
-	if (!idhash)
-		goto out_free;
-	for (unsigned int i = 0; i < HASH_ENTRIES; i++)
-		INIT_LIST_HEAD(&idhash[i]);
+	if (posix_memalign((void **) &shards, CACHELINE_SIZE,
+			IDCACHE_SHARDS * sizeof(struct idcache_shard)))
+		return -ENOMEM;
+	memset(shards, 0, IDCACHE_SHARDS * sizeof(struct idcache_shard));
 
+	for (unsigned int i = 0; i < IDCACHE_SHARDS; i++) {
+		struct idcache_shard *shard = &shards[i];
+
+		shard->entries = calloc(shard_size, sizeof(struct idcache_entry));
+		shard->slots = calloc(shard_slots, sizeof(unsigned int));
+		if (!shard->entries || !shard->slots)
+			goto out_free;
+
+		shard->slot_mask = shard_slots - 1;
+		pthread_mutex_init(&shard->lock, NULL);
+	}
+
+	dbg("ID cache: %u entries, %u hash slots\n", shard_size * IDCACHE_SHARDS, slots);
 	return 0;
 
 out_free:
-	free(idcache);
+	for (unsigned int i = 0; i < IDCACHE_SHARDS; i++) {
+		free(shards[i].entries);
+		free(shards[i].slots);
+	}
+	free(shards);
 	return -ENOMEM;
 }
 
-static list_head_t *get_hash_bucket(unsigned short id)
+static inline uint64_t idcache_hash(packet_dest_t dest, packet_id_t id)
 {
-	unsigned int bucket = ((id & 0xFF) * 33 + (id >> 8)) & HASH_MASK;
-	return idhash + bucket;
+	return hash_64(id ^ ((uint64_t) dest << 32));
 }
 
-static struct idcache_entry *get_bucket_entry(list_head_t *bucket,
-	char dest, unsigned short id)
+/* selects the shard, locks it */
+static struct idcache_shard *lock_shard(packet_dest_t dest, packet_id_t id, unsigned int *hash)
+{
+	uint64_t h = idcache_hash(dest, id);
+	struct idcache_shard *shard = &shards[h & SHARD_MASK];
+
+	*hash = h >> IDCACHE_SHARD_BITS;
+	pthread_mutex_lock(&shard->lock);
+	return shard;
+}
+
+/* finds the slot of an entry, -1 if not found */
+static int find_slot(struct idcache_shard *shard, unsigned int hash,
+	packet_dest_t dest, packet_id_t id)
 {
 	struct idcache_entry *entry;
+	unsigned int mask = shard->slot_mask;
 
-	list_for_each_entry(entry, bucket, hashnode) {
-		if (entry->id == id && entry->dest == dest)
-			return entry;
+	for (unsigned int i = hash & mask; shard->slots[i]; i = (i + 1) & mask) {
+		entry = &shard->entries[shard->slots[i] - 1];
+		if (entry->hash == hash && entry->id == id && entry->dest == dest)
+			return i;
 	}
 
-	return NULL;
+	return -1;
 }
 
-int idcache_put(connection_t *conn, char dest, unsigned short id)
+static struct idcache_entry *find_entry(struct idcache_shard *shard, unsigned int hash,
+	packet_dest_t dest, packet_id_t id)
 {
-	struct idcache_entry *cache;
-	list_head_t *bucket;
+	int slot = find_slot(shard, hash, dest, id);
+	return slot < 0 ? NULL : &shard->entries[shard->slots[slot] - 1];
+}
 
-	pthread_mutex_lock(&idcache_lock);
+/* empties a slot, moves later entries of the probe sequence into the hole */
+static void remove_slot(struct idcache_shard *shard, unsigned int hole)
+{
+	unsigned int mask = shard->slot_mask;
+	unsigned int i, home;
 
-	bucket = get_hash_bucket(id);
-	cache = get_bucket_entry(bucket, dest, id);
-	if (!cache) {
-		// release old, own new connection
-		if (idcache[ptr_write].conn != NULL)
-			connection_release(idcache[ptr_write].conn);
-		connection_own(conn);
+	for (i = (hole + 1) & mask; shard->slots[i]; i = (i + 1) & mask) {
+		home = shard->entries[shard->slots[i] - 1].hash & mask;
 
-		// update entry
-		idcache[ptr_write].conn = conn;
-		idcache[ptr_write].time = 0;
-		idcache[ptr_write].dest = dest;
-		idcache[ptr_write].id = id;
+		// can move unless its home lies between the hole and it
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			shard->slots[hole] = shard->slots[i];
+			hole = i;
+		}
+	}
 
-		// put into hash
-		if (idcache[ptr_write].hashnode.next)
-			list_remove(&idcache[ptr_write].hashnode);
-		list_add(&idcache[ptr_write].hashnode, bucket);
+	shard->slots[hole] = 0;
+}
+
+void idcache_put(connection_t *conn, packet_dest_t dest, packet_id_t id)
+{
+	struct idcache_shard *shard;
+	struct idcache_entry *entry;
+	unsigned int hash, i;
+	ustime_t now = time_monotonic_us();
+
+	shard = lock_shard(dest, id, &hash);
+
+	// an ID wrapped around: the old entry belongs to another packet
+	entry = find_entry(shard, hash, dest, id);
+	if (entry) {
+		if (entry->conn != NULL)
+			connection_release(entry->conn);
+		connection_own(conn);
+		entry->conn = conn;
+		entry->time = now;
+		pthread_mutex_unlock(&shard->lock);
+		return;
+	}
+
+	entry = &shard->entries[shard->ptr_write];
 
-		// increment write pointer
-		ptr_write = (ptr_write + 1) % PACKET_ID_CACHE_SIZE;
+	// evict the oldest entry
+	if (entry->used) {
+		remove_slot(shard, find_slot(shard, entry->hash, entry->dest, entry->id));
+		if (entry->conn != NULL)
+			connection_release(entry->conn);
 	}
+	connection_own(conn);
 
-	pthread_mutex_unlock(&idcache_lock);
+	// update entry
+	entry->conn = conn;
+	entry->time = now;
+	entry->hash = hash;
+	entry->dest = dest;
+	entry->id = id;
+	entry->used = 1;
 
-	return cache != NULL;
+	// put into hash
+	for (i = hash & shard->slot_mask; shard->slots[i]; i = (i + 1) & shard->slot_mask)
+		;
+	shard->slots[i] = shard->ptr_write + 1;
+
+	// increment write pointer
+	shard->ptr_write = (shard->ptr_write + 1) % shard_size;
+
+	pthread_mutex_unlock(&shard->lock);
 }
 
 
-connection_t *idcache_get_origin(char dest, unsigned short id, mstime_t *time_sent)
+connection_t *idcache_get_origin(packet_dest_t dest, packet_id_t id, ustime_t *time_received)
 {
+	struct idcache_shard *shard;
 	struct idcache_entry *cache;
 	connection_t *ret = NULL;
-	list_head_t *bucket;
+	unsigned int hash;
 
-	pthread_mutex_lock(&idcache_lock);
+	shard = lock_shard(dest, id, &hash);
 
-	bucket = get_hash_bucket(id);
-	cache = get_bucket_entry(bucket, dest, id);
+	cache = find_entry(shard, hash, dest, id);
 	if (cache && cache->conn) {
 		// Just return the connection. the resulting connection must
 		// be connection_released() by the caller. Since the the cache will
@@ -134,26 +228,11 @@ connection_t *idcache_get_origin(char dest, unsigned short id, mstime_t *time_se
 		// to work with implementations from other sudents...)
 		cache->conn = NULL;
 
-		if (time_sent)
-			*time_sent = cache->time;
+		if (time_received)
+			*time_received = cache->time;
 	}
 
-	pthread_mutex_unlock(&idcache_lock);
+	pthread_mutex_unlock(&shard->lock);
 
 	return ret;
 }
-
-void idcache_set_timestamp(char dest, unsigned short id)
-{
-	struct idcache_entry *cache;
-	list_head_t *bucket;
-
-	pthread_mutex_lock(&idcache_lock);
-
-	bucket = get_hash_bucket(id);
-	cache = get_bucket_entry(bucket, dest, id);
-	if (cache)
-		cache->time = time_current();
-
-	pthread_mutex_unlock(&idcache_lock);
-}
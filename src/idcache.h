@@ -2,7 +2,8 @@
 #define IDCACHE_H
 
 /**
- * Pack ID cache - a buffer caching packet IDs with it's origin
+ * Pack ID cache - a buffer caching packet IDs with it's origin, for sending
+ * back the acks
  *
  * Written by Daniel Ritz
  */
@@ -10,19 +11,29 @@
 #include "connection.h"
 #include "lib/utils.h"
 
+/** default number of cached packet IDs */
+#define IDCACHE_DEFAULT_SIZE	16384
+
 /**
  * initializes the ID cache
+ * @param size number of packet IDs remembered. The oldest one is forgotten
+ * when a new ID is put into a full cache
+ * @param slots number of hash slots, a power of two, more than size. 0 for
+ * twice the size
+ * @return 0 on success, -EINVAL on invalid sizes, other error code (negative)
  */
-int idcache_initialize();
+int idcache_initialize(unsigned int size, unsigned int slots);
 
 /**
- * puts a new ID into the cache if not already there
+ * puts a new ID with its origin and the current time into the cache. An
+ * entry with the same ID is overwritten: duplicates are detected by the
+ * dupfilter, an entry still there belongs to an older packet with the ID
+ * wrapped around.
  * @param conn the connection the packet originates from
  * @param dest the destination of the packet
  * @param the packet ID
- * @return true value if ID already in cache, 0 otherwise
  */
-int idcache_put(connection_t *conn, char dest, unsigned short id);
+void idcache_put(connection_t *conn, packet_dest_t dest, packet_id_t id);
 
 /**
  * Searches a packet ID in the cache. Returns the originating connection that
@@ -30,15 +41,10 @@ int idcache_put(connection_t *conn, char dest, unsigned short id);
  * will return NULL to prevent sending 'O' packets multiple times.
  * @param dest the destination
  * @param id the packet ID
+ * @param time_received receives the time the packet was put into the cache,
+ * time_monotonic_us(). May be NULL
  * @return the originating connection of NULL if not found or already found before
  */
-connection_t *idcache_get_origin(char dest, unsigned short id, mstime_t *time_sent);
-
-/**
- * Sets the timestamp of a cached entry before sending.
- * @param dest the destination
- * @param id the packet ID
- */
-void idcache_set_timestamp(char dest, unsigned short id);
+connection_t *idcache_get_origin(packet_dest_t dest, packet_id_t id, ustime_t *time_received);
 
 #endif
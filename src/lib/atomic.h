@@ -0,0 +1,66 @@
+#ifndef LIB_ATOMIC_H
+#define LIB_ATOMIC_H
+
+/**
+ * @file atomic.h
+ * @brief
+ * atomic operations and memory barriers, thin wrappers around the GCC/Clang
+ * __atomic builtins (C11 memory model). Naming loosely follows the Linux kernel.
+ */
+
+/** size of a cache line, used to avoid false sharing */
+#define CACHELINE_SIZE		64
+
+/** aligns a variable or struct member to a cache line */
+#define __cacheline_aligned	__attribute__((aligned(CACHELINE_SIZE)))
+
+/* plain loads and stores */
+#define atomic_load_relaxed(ptr)		__atomic_load_n(ptr, __ATOMIC_RELAXED)
+#define atomic_load_acquire(ptr)		__atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define atomic_load_seq_cst(ptr)		__atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+#define atomic_store_relaxed(ptr, val)	__atomic_store_n(ptr, val, __ATOMIC_RELAXED)
+#define atomic_store_release(ptr, val)	__atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+
+/* read-modify-write, all fully ordered */
+#define atomic_add_return(ptr, val)		__atomic_add_fetch(ptr, val, __ATOMIC_SEQ_CST)
+#define atomic_sub_return(ptr, val)		__atomic_sub_fetch(ptr, val, __ATOMIC_SEQ_CST)
+#define atomic_inc(ptr)					((void) __atomic_add_fetch(ptr, 1, __ATOMIC_SEQ_CST))
+#define atomic_dec(ptr)					((void) __atomic_sub_fetch(ptr, 1, __ATOMIC_SEQ_CST))
+#define atomic_xchg(ptr, val)			__atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST)
+
+/**
+ * compare and swap, weak: may fail spuriously. On failure, *expected is
+ * updated with the current value.
+ * @return true value on success
+ */
+#define atomic_cmpxchg_weak(ptr, expected, desired) \
+	__atomic_compare_exchange_n(ptr, expected, desired, 1, \
+		__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
+
+/* counters and flags that don't order anything */
+#define atomic_add_relaxed(ptr, val)	((void) __atomic_add_fetch(ptr, val, __ATOMIC_RELAXED))
+#define atomic_fetch_add_relaxed(ptr, val)	__atomic_fetch_add(ptr, val, __ATOMIC_RELAXED)
+#define atomic_fetch_or_relaxed(ptr, val)	__atomic_fetch_or(ptr, val, __ATOMIC_RELAXED)
+
+/**
+ * reference counting: taking a reference orders nothing, dropping one
+ * releases the changes made through it. The side dropping the last
+ * reference needs smp_acquire() before tearing down the object.
+ */
+#define atomic_inc_relaxed(ptr)			((void) __atomic_add_fetch(ptr, 1, __ATOMIC_RELAXED))
+#define atomic_dec_return_release(ptr)	__atomic_sub_fetch(ptr, 1, __ATOMIC_RELEASE)
+
+/** full memory barrier */
+#define smp_mb()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/** acquire barrier: later loads and stores stay after earlier loads */
+#define smp_acquire()	__atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+/** hint to the CPU in busy-wait loops */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()		__asm__ __volatile__("pause" ::: "memory")
+#else
+#define cpu_relax()		__asm__ __volatile__("" ::: "memory")
+#endif
+
+#endif /* LIB_ATOMIC_H */
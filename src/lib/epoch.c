@@ -0,0 +1,166 @@
+/*
+ * Epoch based reclamation
+ *
+ * Each thread has a record holding the epoch it's reading in, shifted left by
+ * one with the lowest bit set while in a read section. Records are never
+ * freed, the record of an exited thread is reused by the next new thread.
+ *
+ * Written by agent
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "atomic.h"
+#include "list.h"
+#include "epoch.h"
+
+#define EPOCH_ACTIVE	1UL
+
+/** per-thread record */
+struct epoch_rec {
+	unsigned long state;
+	unsigned int nest;
+	int in_use;
+	list_head_t list_entry;
+} __cacheline_aligned;
+
+static unsigned long global_epoch = 1;
+
+// records and retired objects, protected by epoch_lock
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(rec_list);
+static epoch_entry_t *retired_head;
+static epoch_entry_t **retired_tail = &retired_head;
+
+static pthread_key_t rec_key;
+static pthread_once_t rec_key_once = PTHREAD_ONCE_INIT;
+static __thread struct epoch_rec *rec;
+
+static void rec_destroy(void *arg)
+{
+	struct epoch_rec *r = arg;
+
+	pthread_mutex_lock(&epoch_lock);
+	atomic_store_release(&r->state, 0);
+	r->nest = 0;
+	r->in_use = 0;
+	pthread_mutex_unlock(&epoch_lock);
+
+	rec = NULL;
+}
+
+static void rec_key_create()
+{
+	pthread_key_create(&rec_key, rec_destroy);
+}
+
+static struct epoch_rec *rec_get()
+{
+	struct epoch_rec *r;
+
+	if (rec)
+		return rec;
+
+	pthread_once(&rec_key_once, rec_key_create);
+
+	pthread_mutex_lock(&epoch_lock);
+	list_for_each_entry(r, &rec_list, list_entry) {
+		if (!r->in_use) {
+			rec = r;
+			break;
+		}
+	}
+	if (!rec) {
+		// a reader without record would be unsafe, nothing sensible left to do
+		if (posix_memalign((void **) &rec, CACHELINE_SIZE, sizeof(*rec)))
+			abort();
+		memset(rec, 0, sizeof(*rec));
+		list_add(&rec->list_entry, &rec_list);
+	}
+	rec->in_use = 1;
+	pthread_mutex_unlock(&epoch_lock);
+
+	pthread_setspecific(rec_key, rec);
+	return rec;
+}
+
+void epoch_enter()
+{
+	struct epoch_rec *r = rec_get();
+	unsigned long epoch;
+
+	if (r->nest++)
+		return;
+
+	/*
+	 * publish the epoch, then make sure it's still current: a writer that
+	 * advanced it in between didn't see this thread yet
+	 */
+	do {
+		epoch = atomic_load_relaxed(&global_epoch);
+		atomic_store_relaxed(&r->state, (epoch << 1) | EPOCH_ACTIVE);
+		smp_mb();
+	} while (atomic_load_relaxed(&global_epoch) != epoch);
+}
+
+void epoch_exit()
+{
+	struct epoch_rec *r = rec;
+
+	if (--r->nest == 0)
+		atomic_store_release(&r->state, 0);
+}
+
+/* advances the global epoch if all readers are in the current one, epoch_lock held */
+static void epoch_try_advance()
+{
+	unsigned long epoch = global_epoch, state;
+	struct epoch_rec *r;
+
+	list_for_each_entry(r, &rec_list, list_entry) {
+		state = atomic_load_acquire(&r->state);
+		if ((state & EPOCH_ACTIVE) && (state >> 1) != epoch)
+			return;
+	}
+
+	atomic_store_release(&global_epoch, epoch + 1);
+	smp_mb();
+}
+
+void epoch_retire(epoch_entry_t *entry, void (*free)(epoch_entry_t *entry))
+{
+	epoch_entry_t *done = NULL, *last = NULL, *next;
+
+	entry->free = free;
+	entry->next = NULL;
+
+	pthread_mutex_lock(&epoch_lock);
+	entry->epoch = global_epoch;
+	*retired_tail = entry;
+	retired_tail = &entry->next;
+
+	// without active readers, that's enough to free the entry right away
+	epoch_try_advance();
+	epoch_try_advance();
+
+	// two epochs later no reader can see the objects anymore
+	done = retired_head;
+	while (retired_head && retired_head->epoch + 2 <= global_epoch) {
+		last = retired_head;
+		retired_head = retired_head->next;
+	}
+	if (last)
+		last->next = NULL;
+	else
+		done = NULL;
+	if (!retired_head)
+		retired_tail = &retired_head;
+	pthread_mutex_unlock(&epoch_lock);
+
+	for (; done; done = next) {
+		next = done->next;
+		done->free(done);
+	}
+}
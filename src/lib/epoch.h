@@ -0,0 +1,55 @@
+#ifndef LIB_EPOCH_H
+#define LIB_EPOCH_H
+
+/**
+ * @file epoch.h
+ * @brief
+ * epoch based reclamation: lets readers traverse shared data structures
+ * without any lock while writers unlink and free objects. A reader marks
+ * itself active in the current global epoch; an unlinked object is retired
+ * and only freed once the global epoch advanced twice, i.e. when no reader
+ * can still hold a pointer to it. The epoch only advances when all active
+ * readers have seen the current one.
+ *
+ * Usage, reading side:
+ *   epoch_enter();
+ *   p = atomic_load_acquire(&shared);
+ *   ... use p ...
+ *   epoch_exit();
+ * Writing side (serialized by the data structure's own lock):
+ *   old = shared;
+ *   atomic_store_release(&shared, new);
+ *   epoch_retire(&old->epoch_entry, free_fn);
+ *
+ * Retired objects are freed by later calls to epoch_retire(), from whichever
+ * thread does them. Read sections may nest and must not block for long.
+ *
+ * Written by agent
+ */
+
+/** an object waiting to be freed, embedded in the object */
+typedef struct epoch_entry {
+	struct epoch_entry *next;
+	unsigned long epoch;
+	void (*free)(struct epoch_entry *entry);
+} epoch_entry_t;
+
+/**
+ * enters a read side section in the calling thread
+ */
+void epoch_enter();
+
+/**
+ * leaves a read side section
+ */
+void epoch_exit();
+
+/**
+ * retires an unlinked object: free is called once no reader can access it
+ * anymore. May free previously retired objects.
+ * @param entry the entry embedded in the object
+ * @param free the function freeing the object
+ */
+void epoch_retire(epoch_entry_t *entry, void (*free)(epoch_entry_t *entry));
+
+#endif
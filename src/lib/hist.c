@@ -0,0 +1,57 @@
+/*
+ * Log-linear histogram
+ *
+ * Written by agent
+ */
+
+#include "hist.h"
+
+/* the highest value counted by a bucket */
+static uint64_t bucket_high(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < HIST_SUB_BUCKETS)
+		return idx;
+
+	shift = idx / HIST_SUB_BUCKETS - 1;
+	return (((uint64_t) (HIST_SUB_BUCKETS + idx % HIST_SUB_BUCKETS) + 1) << shift) - 1;
+}
+
+void hist_merge(hist_t *dst, const hist_t *src)
+{
+	uint64_t max = atomic_load_relaxed(&src->max);
+
+	for (unsigned int i = 0; i < HIST_BUCKETS; i++)
+		dst->buckets[i] += atomic_load_relaxed(&src->buckets[i]);
+	dst->count += atomic_load_relaxed(&src->count);
+	dst->sum += atomic_load_relaxed(&src->sum);
+	if (max > dst->max)
+		dst->max = max;
+}
+
+uint64_t hist_quantile(const hist_t *h, double q)
+{
+	unsigned long total = 0, rank, seen = 0;
+	uint64_t value;
+
+	// the count field may lag behind the buckets, count them
+	for (unsigned int i = 0; i < HIST_BUCKETS; i++)
+		total += h->buckets[i];
+	if (!total)
+		return 0;
+
+	rank = q * total;
+	if (rank >= total)
+		rank = total - 1;
+
+	for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > rank) {
+			value = bucket_high(i);
+			return value < h->max ? value : h->max;
+		}
+	}
+
+	return h->max;
+}
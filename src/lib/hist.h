@@ -0,0 +1,85 @@
+#ifndef LIB_HIST_H
+#define LIB_HIST_H
+
+/**
+ * @file hist.h
+ * @brief
+ * log-linear histogram in the style of HdrHistogram: values below
+ * HIST_SUB_BUCKETS are counted exactly, above each power of two is split
+ * into HIST_SUB_BUCKETS linear buckets, i.e. the relative error is below
+ * 1 / HIST_SUB_BUCKETS. Values of HIST_VALUE_BITS bits and more all go
+ * into the last bucket. Recording is a few instructions and never
+ * allocates; histograms of several threads are merged for readout.
+ *
+ * Written by agent
+ */
+
+#include <stdint.h>
+
+#include "atomic.h"
+
+#define HIST_SUB_BITS		4
+#define HIST_SUB_BUCKETS	(1 << HIST_SUB_BITS)
+
+/** values counted precisely: 2^40 microseconds are 12 days */
+#define HIST_VALUE_BITS		40
+
+#define HIST_BUCKETS		((HIST_VALUE_BITS - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+typedef struct hist {
+	unsigned long count;
+	uint64_t sum;
+	uint64_t max;
+	unsigned long buckets[HIST_BUCKETS];
+} hist_t;
+
+/**
+ * @param value a value
+ * @return the index of the bucket counting value
+ */
+static inline unsigned int hist_bucket(uint64_t value)
+{
+	unsigned int shift;
+
+	if (value < HIST_SUB_BUCKETS)
+		return value;
+	if (value >> HIST_VALUE_BITS)
+		return HIST_BUCKETS - 1;
+
+	shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB_BUCKETS + ((value >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+/**
+ * records a value in a histogram only written by the calling thread.
+ * Readers on other threads see consistent counts, just not all at once.
+ * @param h the histogram
+ * @param value the value
+ */
+static inline void hist_record(hist_t *h, uint64_t value)
+{
+	unsigned long *bucket = &h->buckets[hist_bucket(value)];
+
+	atomic_store_relaxed(bucket, *bucket + 1);
+	atomic_store_relaxed(&h->sum, h->sum + value);
+	if (value > h->max)
+		atomic_store_relaxed(&h->max, value);
+	atomic_store_relaxed(&h->count, h->count + 1);
+}
+
+/**
+ * adds the counts of a histogram to another one
+ * @param dst the histogram added to, only used by the calling thread
+ * @param src the histogram to add, may be written meanwhile
+ */
+void hist_merge(hist_t *dst, const hist_t *src);
+
+/**
+ * @param h the histogram
+ * @param q the quantile, 0.0 to 1.0
+ * @return the highest value of the bucket holding the quantile, not more
+ * than the max. value recorded. 0 if the histogram is empty
+ */
+uint64_t hist_quantile(const hist_t *h, double q);
+
+#endif /* LIB_HIST_H */
@@ -130,6 +130,30 @@ static inline int list_empty(list_head_t *head)
 	return head->next == head;
 }
 
+static inline void __list_splice(list_head_t *list, list_head_t *prev, list_head_t *next)
+{
+	list_head_t *first = list->next;
+	list_head_t *last = list->prev;
+
+	first->prev = prev;
+	prev->next = first;
+
+	last->next = next;
+	next->prev = last;
+}
+
+/**
+ * list_splice_init - join two lists and reinitialise the emptied list.
+ * @param list the new list to add.
+ * @param head the place to add it in the first list.
+ */
+static inline void list_splice_init(list_head_t *list, list_head_t *head)
+{
+	if (!list_empty(list)) {
+		__list_splice(list, head, head->next);
+		INIT_LIST_HEAD(list);
+	}
+}
 
 /**
  * Returns true if there is a next element
@@ -0,0 +1,513 @@
+/*
+ * Asynchronous debug log
+ *
+ * Each ring is single producer (its thread) single consumer (the drainer, or
+ * log_flush() under drain_lock). A record is a header followed by 64 bit
+ * argument slots, strings stored as length slot plus the padded bytes. A
+ * record never wraps: the space left at the end is filled by a pad record.
+ * Rings are never freed, the ring of an exited thread is reused by the next
+ * new thread.
+ *
+ * Written by agent
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "atomic.h"
+#include "utils.h"
+#include "log.h"
+
+#define LOG_RING_MASK	(LOG_RING_SIZE - 1)
+#define LOG_PAD			1
+
+/** bytes of formatted records written at once */
+#define LOG_BATCH_SIZE	(64 * 1024)
+
+/** max. length of a formatted message */
+#define LOG_LINE_MAX	1024
+
+struct log_rec {
+	uint32_t size;
+	uint32_t flags;
+	ustime_t time;
+	const char *fmt;
+	uint64_t args[];
+};
+
+struct log_ring {
+	unsigned long head __cacheline_aligned;
+	unsigned long dropped;
+	unsigned long tail __cacheline_aligned;
+	unsigned long reported;
+	int in_use;
+	char buf[LOG_RING_SIZE] __cacheline_aligned;
+};
+
+/** a parsed conversion specification */
+struct log_spec {
+	char conv;
+	char len;
+	int stars;
+};
+
+static struct log_ring *rings[LOG_MAX_THREADS];
+static unsigned int num_rings;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int enabled;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread struct log_ring *ring;
+
+static void ring_destroy(void *arg)
+{
+	struct log_ring *r = arg;
+
+	pthread_mutex_lock(&ring_lock);
+	r->in_use = 0;
+	pthread_mutex_unlock(&ring_lock);
+
+	ring = NULL;
+}
+
+static void ring_key_create()
+{
+	pthread_key_create(&ring_key, ring_destroy);
+}
+
+static struct log_ring *ring_get()
+{
+	struct log_ring *r = NULL;
+
+	if (ring)
+		return ring;
+
+	pthread_once(&ring_key_once, ring_key_create);
+
+	pthread_mutex_lock(&ring_lock);
+	for (unsigned int i = 0; i < num_rings; i++) {
+		if (!rings[i]->in_use) {
+			r = rings[i];
+			break;
+		}
+	}
+	if (!r && num_rings < LOG_MAX_THREADS &&
+	    !posix_memalign((void **) &r, CACHELINE_SIZE, sizeof(*r))) {
+		r->head = r->tail = 0;
+		r->dropped = r->reported = 0;
+		atomic_store_release(&rings[num_rings], r);
+		atomic_store_release(&num_rings, num_rings + 1);
+	}
+	if (r)
+		r->in_use = 1;
+	pthread_mutex_unlock(&ring_lock);
+
+	if (r) {
+		ring = r;
+		pthread_setspecific(ring_key, r);
+	}
+	return r;
+}
+
+/* parses a conversion specification after the '%', returns its end */
+static const char *spec_parse(const char *p, struct log_spec *s)
+{
+	s->stars = 0;
+	s->len = 0;
+
+	while (*p && strchr("-+ #0'", *p))
+		p++;
+	if (*p == '*') {
+		s->stars++;
+		p++;
+	}
+	while (isdigit(*p))
+		p++;
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			s->stars++;
+			p++;
+		}
+		while (isdigit(*p))
+			p++;
+	}
+
+	// length modifiers, 'H' for hh and 'q' for ll
+	if (*p && strchr("hlLqjzt", *p)) {
+		s->len = *p++;
+		if (s->len == 'h' && *p == 'h') {
+			s->len = 'H';
+			p++;
+		} else if (s->len == 'l' && *p == 'l') {
+			s->len = 'q';
+			p++;
+		}
+	}
+
+	s->conv = *p;
+	return *p ? p + 1 : p;
+}
+
+/* takes an integer argument of the given length off the list */
+static uint64_t arg_int(va_list *ap, char len, int is_signed)
+{
+	switch (len) {
+	case 'l':
+		return is_signed ? (uint64_t) va_arg(*ap, long) : va_arg(*ap, unsigned long);
+	case 'q':
+		return is_signed ? (uint64_t) va_arg(*ap, long long) : va_arg(*ap, unsigned long long);
+	case 'j':
+		return is_signed ? (uint64_t) va_arg(*ap, intmax_t) : va_arg(*ap, uintmax_t);
+	case 'z':
+		return is_signed ? (uint64_t) va_arg(*ap, ssize_t) : va_arg(*ap, size_t);
+	case 't':
+		return va_arg(*ap, ptrdiff_t);
+	default:
+		return is_signed ? (uint64_t) va_arg(*ap, int) : va_arg(*ap, unsigned int);
+	}
+}
+
+/* encodes the arguments into slots, returns the number of slots used */
+static int rec_encode(const char *fmt, va_list *ap, uint64_t *slots, unsigned int max)
+{
+	struct log_spec s;
+	unsigned int n = 0;
+	const char *str;
+	size_t len;
+	double d;
+
+	while ((fmt = strchr(fmt, '%'))) {
+		fmt = spec_parse(fmt + 1, &s);
+
+		if (n + s.stars + 1 > max)
+			return -E2BIG;
+		for (int i = 0; i < s.stars; i++)
+			slots[n++] = va_arg(*ap, int);
+
+		switch (s.conv) {
+		case '%':
+			break;
+		case 'd':
+		case 'i':
+			slots[n++] = arg_int(ap, s.len, 1);
+			break;
+		case 'o':
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'c':
+			slots[n++] = arg_int(ap, s.len, 0);
+			break;
+		case 'f':
+		case 'F':
+		case 'e':
+		case 'E':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			d = s.len == 'L' ? (double) va_arg(*ap, long double) : va_arg(*ap, double);
+			memcpy(&slots[n++], &d, sizeof(d));
+			break;
+		case 'p':
+			slots[n++] = (uintptr_t) va_arg(*ap, void *);
+			break;
+		case 's':
+			str = va_arg(*ap, const char *);
+			if (!str)
+				str = "(null)";
+			len = strnlen(str, LOG_STR_MAX);
+			if (n + 1 + (len + 7) / 8 > max)
+				return -E2BIG;
+			slots[n++] = len;
+			memcpy(&slots[n], str, len);
+			n += (len + 7) / 8;
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	return n;
+}
+
+int log_vrecord(const char *fmt, va_list ap)
+{
+	uint64_t rec_buf[LOG_REC_MAX / sizeof(uint64_t)];
+	struct log_rec *rec = (struct log_rec *) rec_buf, *pad;
+	struct log_ring *r;
+	unsigned long head, tail, room;
+	unsigned int size;
+	va_list args;
+	int n;
+
+	r = ring_get();
+	if (!r)
+		return -ENOMEM;
+
+	va_copy(args, ap);
+	n = rec_encode(fmt, &args, rec->args, (LOG_REC_MAX - sizeof(*rec)) / sizeof(uint64_t));
+	va_end(args);
+	if (n < 0)
+		return n;
+
+	size = sizeof(*rec) + n * sizeof(uint64_t);
+	rec->size = size;
+	rec->flags = 0;
+	rec->time = time_monotonic_us();
+	rec->fmt = fmt;
+
+	// the producer owns head, the drainer owns tail
+	head = r->head;
+	tail = atomic_load_acquire(&r->tail);
+	room = LOG_RING_SIZE - (head & LOG_RING_MASK);
+	if (LOG_RING_SIZE - (head - tail) < size + (room < size ? room : 0)) {
+		atomic_store_relaxed(&r->dropped, r->dropped + 1);
+		return 0;
+	}
+
+	if (room < size) {
+		pad = (struct log_rec *) (r->buf + (head & LOG_RING_MASK));
+		pad->size = room;
+		pad->flags = LOG_PAD;
+		head += room;
+	}
+
+	memcpy(r->buf + (head & LOG_RING_MASK), rec, size);
+	atomic_store_release(&r->head, head + size);
+
+	return 0;
+}
+
+/* returns the next record between tail and head, skipping pads, or NULL */
+static struct log_rec *ring_peek(struct log_ring *r, unsigned long *tail, unsigned long head)
+{
+	struct log_rec *rec;
+
+	while (*tail != head) {
+		rec = (struct log_rec *) (r->buf + (*tail & LOG_RING_MASK));
+		if (!(rec->flags & LOG_PAD))
+			return rec;
+		*tail += rec->size;
+	}
+
+	return NULL;
+}
+
+/* formats one conversion, like snprintf() */
+static int spec_print(char *out, size_t size, const char *spec, const struct log_spec *s,
+	const uint64_t *slots)
+{
+	int star[2] = { 0, 0 };
+	char str[LOG_STR_MAX + 1];
+	double d;
+
+	for (int i = 0; i < s->stars; i++)
+		star[i] = (int) *slots++;
+
+#define SPEC_PRINT(val) \
+	(s->stars == 0 ? snprintf(out, size, spec, val) : \
+	 s->stars == 1 ? snprintf(out, size, spec, star[0], val) : \
+	 snprintf(out, size, spec, star[0], star[1], val))
+
+	switch (s->conv) {
+	case 'd':
+	case 'i':
+	case 'o':
+	case 'u':
+	case 'x':
+	case 'X':
+	case 'c':
+		switch (s->len) {
+		case 'l':
+			return SPEC_PRINT((long) *slots);
+		case 'q':
+			return SPEC_PRINT((long long) *slots);
+		case 'j':
+			return SPEC_PRINT((intmax_t) *slots);
+		case 'z':
+			return SPEC_PRINT((size_t) *slots);
+		case 't':
+			return SPEC_PRINT((ptrdiff_t) *slots);
+		default:
+			return SPEC_PRINT((int) *slots);
+		}
+	case 'p':
+		return SPEC_PRINT((void *) (uintptr_t) *slots);
+	case 's':
+		memcpy(str, slots + 1, *slots);
+		str[*slots] = '\0';
+		return SPEC_PRINT(str);
+	default:
+		memcpy(&d, slots, sizeof(d));
+		if (s->len == 'L')
+			return SPEC_PRINT((long double) d);
+		return SPEC_PRINT(d);
+	}
+
+#undef SPEC_PRINT
+}
+
+/* formats a record into out, returns the length */
+static size_t rec_format(const struct log_rec *rec, const char *prefix, char *out, size_t size)
+{
+	const char *fmt = rec->fmt, *start;
+	const uint64_t *slots = rec->args;
+	struct log_spec s;
+	char spec[32];
+	size_t len = 0;
+	int n;
+
+	if (prefix)
+		len = snprintf(out, size, "%s", prefix);
+
+	while (*fmt && len < size - 1) {
+		if (*fmt != '%') {
+			out[len++] = *fmt++;
+			continue;
+		}
+
+		start = fmt;
+		fmt = spec_parse(fmt + 1, &s);
+		if (s.conv == '%') {
+			out[len++] = '%';
+			continue;
+		}
+
+		n = fmt - start < (int) sizeof(spec) ? fmt - start : 0;
+		memcpy(spec, start, n);
+		spec[n] = '\0';
+		n = spec_print(out + len, size - len, spec, &s, slots);
+		if (n > 0)
+			len += (size_t) n < size - len ? (size_t) n : size - len - 1;
+
+		slots += s.stars + (s.conv == 's' ? 1 + (slots[s.stars] + 7) / 8 : 1);
+	}
+
+	out[len] = '\0';
+	return len;
+}
+
+/* one pass over all rings, merging the records in time order, drain_lock held */
+static int log_drain()
+{
+	static unsigned long heads[LOG_MAX_THREADS], tails[LOG_MAX_THREADS];
+	static char batch[LOG_BATCH_SIZE];
+	struct log_rec *rec, *next;
+	const char *prefix = debug_get_prefix();
+	unsigned int count, min, done = 0;
+	unsigned long dropped;
+	size_t len = 0;
+
+	count = atomic_load_acquire(&num_rings);
+	for (unsigned int i = 0; i < count; i++) {
+		struct log_ring *r = atomic_load_acquire(&rings[i]);
+
+		heads[i] = atomic_load_acquire(&r->head);
+		tails[i] = r->tail;
+	}
+
+	for (;;) {
+		rec = NULL;
+		min = 0;
+		for (unsigned int i = 0; i < count; i++) {
+			next = ring_peek(rings[i], &tails[i], heads[i]);
+			if (next && (!rec || next->time < rec->time)) {
+				rec = next;
+				min = i;
+			}
+		}
+
+		// flush the batch when full or at the end, then free the ring space
+		if (!rec || LOG_BATCH_SIZE - len < LOG_LINE_MAX) {
+			if (len)
+				fwrite(batch, 1, len, stderr);
+			len = 0;
+			for (unsigned int i = 0; i < count; i++)
+				atomic_store_release(&rings[i]->tail, tails[i]);
+		}
+		if (!rec)
+			break;
+
+		len += rec_format(rec, prefix, batch + len, LOG_LINE_MAX);
+		tails[min] += rec->size;
+		done++;
+	}
+
+	for (unsigned int i = 0; i < count; i++) {
+		dropped = atomic_load_relaxed(&rings[i]->dropped);
+		if (dropped != rings[i]->reported) {
+			fprintf(stderr, "%sLog ring full, %lu message(s) dropped\n",
+				prefix ? prefix : "", dropped - rings[i]->reported);
+			rings[i]->reported = dropped;
+		}
+	}
+
+	return done;
+}
+
+static void *log_thread(void *arg)
+{
+	int done;
+
+	for (;;) {
+		pthread_mutex_lock(&drain_lock);
+		done = log_drain();
+		pthread_mutex_unlock(&drain_lock);
+
+		if (!done)
+			usleep(LOG_DRAIN_INTERVAL * 1000);
+	}
+
+	return NULL;
+}
+
+void log_flush()
+{
+	pthread_mutex_lock(&drain_lock);
+	while (log_drain())
+		;
+	pthread_mutex_unlock(&drain_lock);
+}
+
+int log_initialize()
+{
+	pthread_t thr;
+	int err;
+
+	err = pthread_create(&thr, NULL, log_thread, NULL);
+	if (err)
+		return -err;
+	pthread_detach(thr);
+
+	atexit(log_flush);
+	atomic_store_release(&enabled, 1);
+	return 0;
+}
+
+int log_enabled()
+{
+	return atomic_load_relaxed(&enabled);
+}
+
+unsigned long log_dropped()
+{
+	unsigned long dropped = 0;
+	unsigned int count = atomic_load_acquire(&num_rings);
+
+	for (unsigned int i = 0; i < count; i++)
+		dropped += atomic_load_relaxed(&atomic_load_acquire(&rings[i])->dropped);
+
+	return dropped;
+}
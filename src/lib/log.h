@@ -0,0 +1,68 @@
+#ifndef LIB_LOG_H
+#define LIB_LOG_H
+
+/**
+ * @file log.h
+ * @brief
+ * asynchronous debug log: each thread writes binary records - the format
+ * pointer, the arguments and a timestamp - into its own lock-free ring. A
+ * drainer thread formats them and writes them to stderr in batches, merged
+ * in time order. A thread whose ring is full drops the record and counts it
+ * instead of blocking.
+ *
+ * Format strings must be literals (they're kept by pointer); string
+ * arguments are copied, truncated to LOG_STR_MAX. %n and positional
+ * arguments are not supported.
+ *
+ * Written by agent
+ */
+
+#include <stdarg.h>
+
+/** bytes of log records per thread, a power of two */
+#define LOG_RING_SIZE		(128 * 1024)
+
+/** max. number of threads with a ring, more log synchronously */
+#define LOG_MAX_THREADS		256
+
+/** max. size of one encoded record in bytes */
+#define LOG_REC_MAX			512
+
+/** max. number of bytes of a string argument kept */
+#define LOG_STR_MAX			128
+
+/** milliseconds the drainer sleeps when the rings are empty */
+#define LOG_DRAIN_INTERVAL	10
+
+/**
+ * starts the drainer thread, log_vrecord() is used from now on. The rings
+ * are flushed on exit().
+ * @return 0 on success, error code (negative) otherwise
+ */
+int log_initialize();
+
+/**
+ * @return true value if log_initialize() was called
+ */
+int log_enabled();
+
+/**
+ * records a message in the ring of the calling thread
+ * @param fmt the printf() format, must stay valid
+ * @param ap the arguments
+ * @return 0 if recorded or dropped, error code (negative) if the message
+ * can't be recorded and must be written synchronously
+ */
+int log_vrecord(const char *fmt, va_list ap);
+
+/**
+ * formats and writes all records in the rings, from the calling thread
+ */
+void log_flush();
+
+/**
+ * @return the number of records dropped on full rings so far
+ */
+unsigned long log_dropped();
+
+#endif /* LIB_LOG_H */
@@ -14,6 +14,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include "net.h"
 
@@ -36,6 +37,50 @@ out_close:
 	return -1;
 }
 
+int net_connect_nonblock(struct sockaddr_in *addr)
+{
+	int fd, err;
+
+	fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (fd == -1)
+		return -errno;
+
+	err = net_set_nonblock(fd);
+	if (err)
+		goto out_close;
+
+	err = connect(fd, (struct sockaddr *) addr, sizeof(*addr));
+	if (err == -1 && errno != EINPROGRESS) {
+		err = -errno;
+		goto out_close;
+	}
+
+	return fd;
+
+out_close:
+	close(fd);
+	return err;
+}
+
+int net_connect_result(int fd)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+		return -errno;
+	return -err;
+}
+
+int net_set_nonblock(int fd)
+{
+	int flags;
+
+	flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return -errno;
+	return 0;
+}
 
 int net_listen(short port)
 {
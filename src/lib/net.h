@@ -1,8 +1,14 @@
 #ifndef LIB_NET_H
 #define LIB_NET_H
 
+#include <limits.h>
 #include <netinet/in.h>
 
+/* max. number of buffers for readv()/writev(), not defined everywhere */
+#ifndef IOV_MAX
+#define IOV_MAX		1024
+#endif
+
 
 /**
  * opens a TCP socket to the given host/port
@@ -10,6 +16,28 @@
  */
 int net_connect(struct sockaddr_in *addr);
 
+/**
+ * starts a non-blocking connect to the given host/port. The returned socket is
+ * non-blocking, completion is signaled by the socket becoming writable.
+ * @param addr the address (port already set)
+ * @return socket fd or error code (negative)
+ */
+int net_connect_nonblock(struct sockaddr_in *addr);
+
+/**
+ * returns the result of a non-blocking connect once the socket is writable
+ * @param fd the socket
+ * @return 0 if connected, error code (negative) otherwise
+ */
+int net_connect_result(int fd);
+
+/**
+ * puts a socket into non-blocking mode
+ * @param fd the socket
+ * @return 0 on success, error code (negative) otherwise
+ */
+int net_set_nonblock(int fd);
+
 /**
  * creates a listening TCP socket on the specified port (bind and listen)
  * @param port the port
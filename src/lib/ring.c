@@ -0,0 +1,114 @@
+/*
+ * Bounded lock-free MPMC ring buffer, after Dmitry Vyukov
+ *
+ * Written by agent
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ring.h"
+
+/* a slot: sequence number followed by the element */
+struct ring_slot {
+	unsigned long seq;
+	char data[];
+};
+
+static inline struct ring_slot *ring_slot(ring_t *ring, unsigned long pos)
+{
+	return (struct ring_slot *) (ring->slots + (pos & ring->mask) * ring->stride);
+}
+
+int ring_init(ring_t *ring, unsigned long capacity, size_t elem_size)
+{
+	if (!ring_capacity_valid(capacity))
+		return -EINVAL;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->elem_size = elem_size;
+	ring->stride = sizeof(struct ring_slot) + elem_size;
+	ring->stride = (ring->stride + sizeof(long) - 1) & ~(sizeof(long) - 1);
+	ring->mask = capacity - 1;
+
+	ring->slots = malloc(capacity * ring->stride);
+	if (!ring->slots)
+		return -ENOMEM;
+
+	// slot i is free for the producer at position i
+	for (unsigned long i = 0; i < capacity; i++)
+		ring_slot(ring, i)->seq = i;
+
+	return 0;
+}
+
+void ring_destroy(ring_t *ring)
+{
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+int ring_push(ring_t *ring, const void *elem)
+{
+	struct ring_slot *slot;
+	unsigned long pos, seq;
+	long diff;
+
+	pos = atomic_load_relaxed(&ring->pos_write);
+	for (;;) {
+		slot = ring_slot(ring, pos);
+		seq = atomic_load_acquire(&slot->seq);
+		diff = (long) seq - (long) pos;
+
+		if (diff == 0) {
+			// slot free: claim it
+			if (atomic_cmpxchg_weak(&ring->pos_write, &pos, pos + 1))
+				break;
+		} else if (diff < 0) {
+			// slot still filled from the previous lap: full
+			return -EAGAIN;
+		} else {
+			// another producer was faster
+			pos = atomic_load_relaxed(&ring->pos_write);
+		}
+	}
+
+	memcpy(slot->data, elem, ring->elem_size);
+	atomic_store_release(&slot->seq, pos + 1);
+
+	return 0;
+}
+
+int ring_pop(ring_t *ring, void *elem)
+{
+	struct ring_slot *slot;
+	unsigned long pos, seq;
+	long diff;
+
+	pos = atomic_load_relaxed(&ring->pos_read);
+	for (;;) {
+		slot = ring_slot(ring, pos);
+		seq = atomic_load_acquire(&slot->seq);
+		diff = (long) seq - (long) (pos + 1);
+
+		if (diff == 0) {
+			// slot filled: claim it
+			if (atomic_cmpxchg_weak(&ring->pos_read, &pos, pos + 1))
+				break;
+		} else if (diff < 0) {
+			// slot not yet filled: empty
+			return -EAGAIN;
+		} else {
+			// another consumer was faster
+			pos = atomic_load_relaxed(&ring->pos_read);
+		}
+	}
+
+	memcpy(elem, slot->data, ring->elem_size);
+
+	// free the slot for the producer one lap ahead
+	atomic_store_release(&slot->seq, pos + ring->mask + 1);
+
+	return 0;
+}
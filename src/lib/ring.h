@@ -0,0 +1,92 @@
+#ifndef LIB_RING_H
+#define LIB_RING_H
+
+/**
+ * @file ring.h
+ * @brief
+ * bounded lock-free multi-producer/multi-consumer ring buffer, as described
+ * by Dmitry Vyukov: each slot carries a sequence number telling producers and
+ * consumers whether the slot is free or filled for the current lap. Elements
+ * are copied in and out, the element size is fixed on initialization.
+ *
+ * Written by agent
+ */
+
+#include <stddef.h>
+
+#include "atomic.h"
+
+typedef struct ring {
+	char *slots;
+	size_t stride;
+	size_t elem_size;
+	unsigned long mask;
+
+	// producer and consumer positions, on separate cache lines
+	unsigned long pos_write __cacheline_aligned;
+	unsigned long pos_read __cacheline_aligned;
+} ring_t;
+
+/**
+ * initializes a ring
+ * @param ring the ring
+ * @param capacity number of slots, must be a power of two
+ * @param elem_size size of one element in bytes
+ * @return 0 on success, error code (negative) otherwise
+ */
+int ring_init(ring_t *ring, unsigned long capacity, size_t elem_size);
+
+/**
+ * frees the memory of a ring. Elements still in the ring are lost.
+ * @param ring the ring
+ */
+void ring_destroy(ring_t *ring);
+
+/**
+ * adds an element to the ring, non-blocking
+ * @param ring the ring
+ * @param elem pointer to the element, elem_size bytes are copied
+ * @return 0 on success, -EAGAIN if the ring is full
+ */
+int ring_push(ring_t *ring, const void *elem);
+
+/**
+ * removes an element from the ring, non-blocking
+ * @param ring the ring
+ * @param elem pointer to a buffer receiving the element
+ * @return 0 on success, -EAGAIN if the ring is empty
+ */
+int ring_pop(ring_t *ring, void *elem);
+
+/**
+ * returns the number of elements in the ring. Only a snapshot when used
+ * concurrently.
+ * @param ring the ring
+ * @return number of elements
+ */
+static inline unsigned long ring_count(ring_t *ring)
+{
+	unsigned long w = atomic_load_relaxed(&ring->pos_write);
+	unsigned long r = atomic_load_relaxed(&ring->pos_read);
+	return w > r ? w - r : 0;
+}
+
+/**
+ * @return the capacity of the ring
+ */
+static inline unsigned long ring_capacity(ring_t *ring)
+{
+	return ring->mask + 1;
+}
+
+/**
+ * checks if a number is a valid ring capacity
+ * @param capacity the capacity
+ * @return true value if capacity is a power of two
+ */
+static inline int ring_capacity_valid(unsigned long capacity)
+{
+	return capacity > 0 && (capacity & (capacity - 1)) == 0;
+}
+
+#endif /* LIB_RING_H */
@@ -10,6 +10,7 @@
 #include <pthread.h>
 
 #include "utils.h"
+#include "log.h"
 
 int debug = 0;
 static char *prefix;
@@ -34,6 +35,12 @@ void _dbg(const char *fmt, ...)
 	va_list ap;
 	va_start(ap, fmt);
 
+	// handed to the log drainer if running, written here if it can't be encoded
+	if (log_enabled() && !log_vrecord(fmt, ap)) {
+		va_end(ap);
+		return;
+	}
+
 	pthread_mutex_lock(&util_mutex);
 	if (prefix)
 		fprintf(stderr, "%s", prefix);
@@ -52,3 +59,8 @@ void debug_prefix(char *pf)
 {
 	prefix = strdup(pf);
 }
+
+const char *debug_get_prefix()
+{
+	return prefix;
+}
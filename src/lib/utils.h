@@ -8,7 +8,9 @@
  */
 
 #include <stdio.h>
+#include <time.h>
 #include <sys/time.h>
+#include <stdint.h>
 
 /**
  * checks the return value for error, reports the error
@@ -33,9 +35,15 @@ void set_debug(int ena);
  */
 void debug_prefix(char *pf);
 
+/**
+ * @return the debug message prefix, NULL if none
+ */
+const char *debug_get_prefix();
+
 /**
  * verbose messages printf() wrapper
- * only prints messages in verbose mode
+ * only prints messages in verbose mode, asynchronously once log_initialize()
+ * was called
  */
 void _dbg(const char *fmt, ...);
 #define dbg(...)			\
@@ -45,7 +53,25 @@ void _dbg(const char *fmt, ...);
 	} while (0)
 
 
+/**
+ * mixes the bits of a 64 bit key (the splitmix64 finalizer), every input bit
+ * affects every output bit. For hash tables indexed by the low bits.
+ * @param key the key
+ * @return the hash value
+ */
+static inline uint64_t hash_64(uint64_t key)
+{
+	key ^= key >> 30;
+	key *= 0xbf58476d1ce4e5b9ULL;
+	key ^= key >> 27;
+	key *= 0x94d049bb133111ebULL;
+	key ^= key >> 31;
+	return key;
+}
+
+
 typedef unsigned long long mstime_t;
+typedef unsigned long long ustime_t;
 
 /**
  * @return the milliseconds part of gettimeofday()
@@ -57,4 +83,22 @@ static inline mstime_t time_current()
 	return t.tv_sec * 1000 + t.tv_usec / 1000;
 }
 
+/**
+ * @return a monotonic time in microseconds, for measuring intervals
+ */
+static inline ustime_t time_monotonic_us()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (ustime_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/**
+ * @return a monotonic time in milliseconds, for timeouts
+ */
+static inline mstime_t time_monotonic_ms()
+{
+	return time_monotonic_us() / 1000;
+}
+
 #endif
@@ -0,0 +1,134 @@
+/*
+ * Wait queue (eventcount) for lock-free data structures
+ *
+ * Written by agent
+ */
+
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+
+#ifdef HAVE_FUTEX
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "atomic.h"
+#include "waitq.h"
+
+#ifdef HAVE_FUTEX
+
+static inline void futex_wait(unsigned int *addr, unsigned int val,
+	const struct timespec *timeout)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static inline void futex_wake(unsigned int *addr, int num)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, num, NULL, NULL, 0);
+}
+
+void waitq_init(waitq_t *wq)
+{
+	wq->seq = 0;
+	wq->waiters = 0;
+}
+
+void waitq_wait(waitq_t *wq, unsigned int ticket)
+{
+	// returns immediately if seq changed since waitq_prepare()
+	futex_wait(&wq->seq, ticket, NULL);
+	atomic_dec(&wq->waiters);
+}
+
+void waitq_wait_timeout(waitq_t *wq, unsigned int ticket, unsigned long usec)
+{
+	struct timespec ts = {
+		.tv_sec = usec / 1000000,
+		.tv_nsec = (usec % 1000000) * 1000,
+	};
+
+	futex_wait(&wq->seq, ticket, &ts);
+	atomic_dec(&wq->waiters);
+}
+
+void waitq_wake(waitq_t *wq, int all)
+{
+	// pairs with waitq_prepare(): either we see the waiter or the waiter
+	// sees whatever was made available before this call
+	smp_mb();
+	if (atomic_load_relaxed(&wq->waiters) == 0)
+		return;
+
+	atomic_inc(&wq->seq);
+	futex_wake(&wq->seq, all ? INT_MAX : 1);
+}
+
+#else /* !HAVE_FUTEX */
+
+void waitq_init(waitq_t *wq)
+{
+	wq->seq = 0;
+	wq->waiters = 0;
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->cond, NULL);
+}
+
+void waitq_wait(waitq_t *wq, unsigned int ticket)
+{
+	pthread_mutex_lock(&wq->lock);
+	while (atomic_load_relaxed(&wq->seq) == ticket)
+		pthread_cond_wait(&wq->cond, &wq->lock);
+	pthread_mutex_unlock(&wq->lock);
+	atomic_dec(&wq->waiters);
+}
+
+void waitq_wait_timeout(waitq_t *wq, unsigned int ticket, unsigned long usec)
+{
+	struct timeval now;
+	struct timespec ts;
+
+	gettimeofday(&now, NULL);
+	usec += now.tv_usec;
+	ts.tv_sec = now.tv_sec + usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+
+	pthread_mutex_lock(&wq->lock);
+	while (atomic_load_relaxed(&wq->seq) == ticket) {
+		if (pthread_cond_timedwait(&wq->cond, &wq->lock, &ts) == ETIMEDOUT)
+			break;
+	}
+	pthread_mutex_unlock(&wq->lock);
+	atomic_dec(&wq->waiters);
+}
+
+void waitq_wake(waitq_t *wq, int all)
+{
+	smp_mb();
+	if (atomic_load_relaxed(&wq->waiters) == 0)
+		return;
+
+	pthread_mutex_lock(&wq->lock);
+	atomic_inc(&wq->seq);
+	if (all)
+		pthread_cond_broadcast(&wq->cond);
+	else
+		pthread_cond_signal(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+#endif /* HAVE_FUTEX */
+
+unsigned int waitq_prepare(waitq_t *wq)
+{
+	atomic_inc(&wq->waiters);
+	return atomic_load_seq_cst(&wq->seq);
+}
+
+void waitq_cancel(waitq_t *wq)
+{
+	atomic_dec(&wq->waiters);
+}
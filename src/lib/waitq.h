@@ -0,0 +1,79 @@
+#ifndef LIB_WAITQ_H
+#define LIB_WAITQ_H
+
+/**
+ * @file waitq.h
+ * @brief
+ * wait queue for lock-free data structures (an "eventcount"): threads park
+ * when there's nothing to do, the notifying side only does a syscall if
+ * someone is actually waiting. Uses a futex on Linux, a mutex/condvar pair
+ * elsewhere.
+ *
+ * Usage, waiting side:
+ *   for (;;) {
+ *     if (try_something()) break;
+ *     ticket = waitq_prepare(wq);
+ *     if (try_something()) { waitq_cancel(wq); break; }
+ *     waitq_wait(wq, ticket);
+ *   }
+ * Notifying side: make something available, then call waitq_wake().
+ *
+ * Written by agent
+ */
+
+#ifndef HAVE_FUTEX
+#include <pthread.h>
+#endif
+
+typedef struct waitq {
+	unsigned int seq;
+	unsigned int waiters;
+#ifndef HAVE_FUTEX
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+} waitq_t;
+
+/**
+ * initializes a wait queue
+ * @param wq the wait queue
+ */
+void waitq_init(waitq_t *wq);
+
+/**
+ * registers the caller as waiter. The condition must be re-checked after
+ * this call, followed by either waitq_wait() or waitq_cancel().
+ * @param wq the wait queue
+ * @return the ticket to pass to waitq_wait()
+ */
+unsigned int waitq_prepare(waitq_t *wq);
+
+/**
+ * sleeps until woken up, unless there was a wakeup since waitq_prepare()
+ * @param wq the wait queue
+ * @param ticket the ticket returned by waitq_prepare()
+ */
+void waitq_wait(waitq_t *wq, unsigned int ticket);
+
+/**
+ * like waitq_wait() but with a timeout
+ * @param wq the wait queue
+ * @param ticket the ticket returned by waitq_prepare()
+ * @param usec the timeout in microseconds
+ */
+void waitq_wait_timeout(waitq_t *wq, unsigned int ticket, unsigned long usec);
+
+/**
+ * unregisters the caller as waiter without sleeping
+ * @param wq the wait queue
+ */
+void waitq_cancel(waitq_t *wq);
+
+/**
+ * wakes up waiting threads, if any
+ * @param wq the wait queue
+ * @param all wake all waiters if true, just one otherwise
+ */
+void waitq_wake(waitq_t *wq, int all);
+
+#endif /* LIB_WAITQ_H */
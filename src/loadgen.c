@@ -0,0 +1,519 @@
+/**
+ * Load generator
+ *
+ * One thread drives non-blocking connections: packets are encoded into the
+ * output buffer of a connection as long as its window allows, acks are
+ * parsed from its input buffer. Closed loop keeps every window full, open
+ * loop sends at a fixed rate round robin to the connections with room.
+ * Packets in flight are kept in one slot table indexed by the low bits of
+ * the ID, a slot is only reused once its packet was acked or lost. IDs
+ * whose slot is still taken are skipped.
+ *
+ * Written by agent
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+
+#include "lib/net.h"
+
+#include "loadgen.h"
+
+/** min. size of the input and output buffers */
+#define LOADGEN_BUF_SIZE		(64 * 1024)
+
+/** milliseconds between looking for lost packets */
+#define LOADGEN_EXPIRE_INTERVAL	10
+
+struct loadgen_slot {
+	packet_id_t id;
+	ustime_t sent;
+	unsigned int conn;
+	int used;
+};
+
+struct loadgen_conn {
+	int fd;
+	unsigned int inflight;
+
+	char *out;
+	size_t outlen, outoff;
+	char *in;
+	size_t inlen;
+};
+
+struct loadgen {
+	const struct loadgen_config *cfg;
+	struct loadgen_stats *stats;
+
+	struct loadgen_conn *conns;
+	struct pollfd *pfds;
+	unsigned int num_conns;
+	unsigned int next_conn;
+
+	struct loadgen_slot *slots;
+	unsigned int mask;
+	unsigned int inflight;
+	packet_id_t next_id;
+	ustime_t start;
+	ustime_t last_ack;
+
+	// open loop: packets sent so far, the next one is due at scheduled / rate
+	unsigned long scheduled;
+
+	char *payload;
+	size_t frame_size;
+	size_t bufsize;
+	packet_t *rxpkt;
+};
+
+void loadgen_defaults(struct loadgen_config *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->dest = 1;
+	cfg->payload = 100;
+	cfg->first_id = 1;
+	cfg->version = 1;
+	cfg->window = LOADGEN_DEFAULT_WINDOW;
+	cfg->duration = 5000;
+	cfg->timeout = LOADGEN_DEFAULT_TIMEOUT;
+}
+
+int loadgen_negotiate_v2(int fd, unsigned int *max_payload)
+{
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN,
+	};
+	unsigned char version, flags;
+	packet_t *packet;
+	ssize_t len;
+	int err;
+
+	packet = packet_cre_version(0);
+	if (!packet)
+		return -ENOMEM;
+	len = send(fd, packet->raw, PACKET_SIZE, MSG_NOSIGNAL);
+	if (len != PACKET_SIZE)
+		goto out_err;
+
+	if (poll(&pfd, 1, LOADGEN_DEFAULT_TIMEOUT) != 1) {
+		packet_put(packet);
+		return -ETIMEDOUT;
+	}
+	len = recv(fd, packet->raw, PACKET_SIZE, MSG_WAITALL);
+	if (len != PACKET_SIZE)
+		goto out_err;
+	packet_parse_v1(packet);
+	packet_parse_version(packet, &version, &flags, max_payload);
+	err = packet_get_type(packet) == 'V' && version >= 2 &&
+		(flags & PACKET_VERSION_SWITCH) ? 0 : -EPROTO;
+	packet_put(packet);
+	if (err)
+		return err;
+
+	packet = packet_cre_version(PACKET_VERSION_SWITCH);
+	if (!packet)
+		return -ENOMEM;
+	len = send(fd, packet->raw, PACKET_SIZE, MSG_NOSIGNAL);
+	if (len != PACKET_SIZE)
+		goto out_err;
+	packet_put(packet);
+	return 0;
+
+out_err:
+	packet_put(packet);
+	return len < 0 ? -errno : -EIO;
+}
+
+/* encodes the next packet into the output buffer of a connection */
+static int encode_packet(struct loadgen *lg, struct loadgen_conn *c, packet_id_t id)
+{
+	const struct loadgen_config *cfg = lg->cfg;
+	char *frame = c->out + c->outlen;
+	packet_t *packet;
+	unsigned int hdrlen;
+
+	if (cfg->version < 2) {
+		packet = packet_cre_content(id, cfg->dest, lg->payload, cfg->payload);
+		if (!packet)
+			return -ENOMEM;
+		memcpy(frame, packet->raw, PACKET_SIZE);
+		c->outlen += PACKET_SIZE;
+	} else {
+		packet = packet_cre_message(id, cfg->dest, lg->payload, cfg->payload);
+		if (!packet)
+			return -ENOMEM;
+		hdrlen = packet_v2_header(packet, frame);
+		memcpy(frame + hdrlen, lg->payload, cfg->payload);
+		c->outlen += hdrlen + cfg->payload;
+	}
+
+	packet_put(packet);
+	return 0;
+}
+
+/* whether the window and the output buffer of a connection take a packet */
+static int conn_ready(struct loadgen *lg, struct loadgen_conn *c)
+{
+	return c->inflight < lg->cfg->window && lg->bufsize - c->outlen >= lg->frame_size;
+}
+
+/* queues the next packet on a connection: 1 if queued */
+static int queue_packet(struct loadgen *lg, unsigned int conn, ustime_t sent)
+{
+	struct loadgen_slot *slot;
+	int err;
+
+	// skip the IDs whose slot still holds a lost packet, waiting for it
+	// would stall every window until the timeout. The table has twice
+	// the windows, so there is always a free slot.
+	while ((slot = &lg->slots[lg->next_id & lg->mask])->used)
+		lg->next_id++;
+
+	err = encode_packet(lg, &lg->conns[conn], lg->next_id);
+	if (err)
+		return err;
+
+	slot->id = lg->next_id++;
+	slot->sent = sent;
+	slot->conn = conn;
+	slot->used = 1;
+	lg->conns[conn].inflight++;
+	lg->inflight++;
+	lg->stats->sent++;
+	return 1;
+}
+
+/* when the next packet is due in open loop */
+static ustime_t next_due(struct loadgen *lg)
+{
+	return lg->start + (ustime_t) lg->scheduled * 1000000 / lg->cfg->rate;
+}
+
+/* queues packets while the windows and the output buffers allow */
+static int fill(struct loadgen *lg, ustime_t now)
+{
+	unsigned int i, conn;
+	ustime_t due;
+	int ret;
+
+	// closed loop: fill up every window
+	if (!lg->cfg->rate) {
+		for (i = 0; i < lg->num_conns; i++) {
+			while (conn_ready(lg, &lg->conns[i])) {
+				ret = queue_packet(lg, i, now);
+				if (ret <= 0)
+					return ret;
+			}
+		}
+		return 0;
+	}
+
+	// open loop: the packets due so far, late ones keep their due time
+	while ((due = next_due(lg)) <= now) {
+		for (i = 0; i < lg->num_conns; i++) {
+			conn = (lg->next_conn + i) % lg->num_conns;
+			if (conn_ready(lg, &lg->conns[conn]))
+				break;
+		}
+		if (i == lg->num_conns)
+			break;
+
+		ret = queue_packet(lg, conn, due);
+		if (ret <= 0)
+			return ret;
+		lg->scheduled++;
+		lg->next_conn = (conn + 1) % lg->num_conns;
+	}
+
+	return 0;
+}
+
+static int flush(struct loadgen_conn *c, size_t bufsize)
+{
+	ssize_t len;
+
+	while (c->outoff < c->outlen) {
+		len = send(c->fd, c->out + c->outoff, c->outlen - c->outoff,
+			MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		c->outoff += len;
+	}
+
+	if (c->outoff == c->outlen)
+		c->outoff = c->outlen = 0;
+	else if (c->outoff > bufsize / 2) {
+		memmove(c->out, c->out + c->outoff, c->outlen - c->outoff);
+		c->outlen -= c->outoff;
+		c->outoff = 0;
+	}
+
+	return 0;
+}
+
+static void ack(struct loadgen *lg, packet_id_t id, ustime_t now)
+{
+	struct loadgen_slot *slot = &lg->slots[id & lg->mask];
+	packet_id_t sent_id;
+
+	// version 1 only carries the low 16 bits of the ID
+	sent_id = lg->cfg->version < 2 ? (unsigned short) slot->id : slot->id;
+	if (!slot->used || sent_id != id) {
+		lg->stats->unknown++;
+		return;
+	}
+
+	hist_record(&lg->stats->latency, now > slot->sent ? now - slot->sent : 0);
+	slot->used = 0;
+	lg->conns[slot->conn].inflight--;
+	lg->inflight--;
+	lg->stats->acked++;
+	lg->last_ack = now;
+}
+
+/* parses the complete frames received, handles the acks */
+static int parse(struct loadgen *lg, struct loadgen_conn *c, ustime_t now)
+{
+	struct packet_v2_hdr fields;
+	size_t off = 0, avail, hdrlen;
+	int err;
+
+	for (;;) {
+		avail = c->inlen - off;
+		if (lg->cfg->version < 2) {
+			if (avail < PACKET_SIZE)
+				break;
+			memcpy(lg->rxpkt->raw, c->in + off, PACKET_SIZE);
+			packet_parse_v1(lg->rxpkt);
+			fields.type = packet_get_type(lg->rxpkt);
+			fields.id = packet_get_id(lg->rxpkt);
+			off += PACKET_SIZE;
+		} else {
+			if (avail < 1)
+				break;
+			hdrlen = (unsigned char) c->in[off];
+			if (avail < hdrlen)
+				break;
+			err = packet_v2_parse_header(c->in + off, &fields);
+			if (err)
+				return err;
+			if (hdrlen + fields.len > lg->bufsize)
+				return -EMSGSIZE;
+			if (avail < hdrlen + fields.len)
+				break;
+			off += hdrlen + fields.len;
+		}
+
+		if (fields.type == 'O')
+			ack(lg, fields.id, now);
+	}
+
+	memmove(c->in, c->in + off, c->inlen - off);
+	c->inlen -= off;
+	return 0;
+}
+
+static int receive(struct loadgen *lg, struct loadgen_conn *c, ustime_t now)
+{
+	ssize_t len;
+
+	len = recv(c->fd, c->in + c->inlen, lg->bufsize - c->inlen, MSG_DONTWAIT);
+	if (len == 0)
+		return -ECONNRESET;
+	if (len < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -errno;
+
+	c->inlen += len;
+	return parse(lg, c, now);
+}
+
+/* counts the packets without ack after the timeout as lost */
+static void expire(struct loadgen *lg, ustime_t now)
+{
+	ustime_t timeout = (ustime_t) lg->cfg->timeout * 1000;
+	struct loadgen_slot *slot;
+
+	for (unsigned int i = 0; i <= lg->mask; i++) {
+		slot = &lg->slots[i];
+		if (slot->used && now > slot->sent && now - slot->sent > timeout) {
+			slot->used = 0;
+			lg->conns[slot->conn].inflight--;
+			lg->inflight--;
+			lg->stats->lost++;
+		}
+	}
+}
+
+/* milliseconds to wait for the connections */
+static int poll_timeout(struct loadgen *lg, ustime_t now, ustime_t end)
+{
+	ustime_t due;
+
+	if (!lg->cfg->rate || now >= end)
+		return LOADGEN_EXPIRE_INTERVAL;
+
+	// less than a millisecond to go spins, poll() can't wait shorter
+	due = next_due(lg);
+	if (due <= now)
+		return LOADGEN_EXPIRE_INTERVAL;
+	return due - now < LOADGEN_EXPIRE_INTERVAL * 1000 ? (due - now) / 1000 :
+		LOADGEN_EXPIRE_INTERVAL;
+}
+
+static int loadgen_loop(struct loadgen *lg)
+{
+	struct loadgen_conn *c;
+	ustime_t now, end, last_expire;
+	int err = 0;
+
+	lg->start = last_expire = now = time_monotonic_us();
+	end = lg->start + (ustime_t) lg->cfg->duration * 1000;
+
+	for (;;) {
+		if (now < end) {
+			err = fill(lg, now);
+			if (err)
+				break;
+		} else if (!lg->inflight) {
+			break;
+		}
+
+		for (unsigned int i = 0; i < lg->num_conns; i++) {
+			c = &lg->conns[i];
+			err = flush(c, lg->bufsize);
+			if (err)
+				goto out;
+			lg->pfds[i].events = POLLIN | (c->outlen ? POLLOUT : 0);
+		}
+
+		if (poll(lg->pfds, lg->num_conns, poll_timeout(lg, now, end)) < 0 && errno != EINTR) {
+			err = -errno;
+			break;
+		}
+
+		now = time_monotonic_us();
+		for (unsigned int i = 0; i < lg->num_conns; i++) {
+			if (lg->pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+				err = receive(lg, &lg->conns[i], now);
+				if (err)
+					goto out;
+			}
+		}
+
+		if (now - last_expire >= LOADGEN_EXPIRE_INTERVAL * 1000) {
+			expire(lg, now);
+			last_expire = now;
+		}
+	}
+
+out:
+	lg->stats->elapsed = (lg->last_ack > lg->start ? lg->last_ack : now) - lg->start;
+	return err;
+}
+
+static int conn_open(struct loadgen *lg, struct loadgen_conn *c, struct sockaddr_in *host)
+{
+	unsigned int max_payload;
+	int yes = 1;
+	int err;
+
+	c->out = malloc(lg->bufsize);
+	c->in = malloc(lg->bufsize);
+	if (!c->out || !c->in)
+		return -ENOMEM;
+
+	c->fd = net_connect(host);
+	if (c->fd < 0)
+		return -ECONNREFUSED;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+	if (lg->cfg->version >= 2) {
+		err = loadgen_negotiate_v2(c->fd, &max_payload);
+		if (err)
+			return err;
+		if (lg->cfg->payload > max_payload)
+			return -EMSGSIZE;
+	}
+
+	return 0;
+}
+
+int loadgen_run(struct sockaddr_in *hosts, unsigned int num_hosts,
+	const struct loadgen_config *cfg, struct loadgen_stats *stats)
+{
+	struct loadgen lg;
+	unsigned int slots;
+	int err;
+
+	// the slots are indexed by the low bits of the ID, version 1 has 16
+	if (!num_hosts || !cfg->window || cfg->window > 32768 / num_hosts)
+		return -EINVAL;
+	if (cfg->version < 2 && cfg->payload > PACKET_CONTENT_SIZE)
+		return -EMSGSIZE;
+
+	memset(&lg, 0, sizeof(lg));
+	lg.cfg = cfg;
+	lg.stats = stats;
+	lg.next_id = cfg->first_id;
+	lg.num_conns = num_hosts;
+
+	// twice the windows, lost packets keep their slot until the timeout
+	for (slots = 1; slots < 2 * cfg->window * num_hosts; slots <<= 1)
+		;
+	lg.mask = slots - 1;
+
+	lg.frame_size = cfg->version < 2 ? PACKET_SIZE : PACKET_V2_HDR_SIZE + cfg->payload;
+	lg.bufsize = LOADGEN_BUF_SIZE > 2 * lg.frame_size ? LOADGEN_BUF_SIZE : 2 * lg.frame_size;
+
+	lg.slots = calloc(slots, sizeof(*lg.slots));
+	lg.conns = calloc(num_hosts, sizeof(*lg.conns));
+	lg.pfds = calloc(num_hosts, sizeof(*lg.pfds));
+	lg.payload = malloc(cfg->payload + 1);
+	lg.rxpkt = packet_alloc();
+	err = -ENOMEM;
+	if (!lg.slots || !lg.conns || !lg.pfds || !lg.payload || !lg.rxpkt)
+		goto out_free;
+
+	for (unsigned int i = 0; i < cfg->payload; i++)
+		lg.payload[i] = 'a' + i % 26;
+
+	for (unsigned int i = 0; i < num_hosts; i++)
+		lg.conns[i].fd = -1;
+	for (unsigned int i = 0; i < num_hosts; i++) {
+		err = conn_open(&lg, &lg.conns[i], &hosts[i]);
+		if (err)
+			goto out_close;
+		lg.pfds[i].fd = lg.conns[i].fd;
+	}
+
+	err = loadgen_loop(&lg);
+
+out_close:
+	for (unsigned int i = 0; i < num_hosts; i++) {
+		if (lg.conns[i].fd >= 0)
+			close(lg.conns[i].fd);
+		free(lg.conns[i].in);
+		free(lg.conns[i].out);
+	}
+out_free:
+	if (lg.rxpkt)
+		packet_put(lg.rxpkt);
+	free(lg.payload);
+	free(lg.pfds);
+	free(lg.conns);
+	free(lg.slots);
+	return err;
+}
@@ -0,0 +1,93 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+/**
+ * Load generator - pipelines 'C' packets to meshy nodes over persistent
+ * connections and matches the returning 'O' acks by ID
+ *
+ * Written by agent
+ */
+
+#include <netinet/in.h>
+
+#include "lib/utils.h"
+#include "lib/hist.h"
+
+#include "packet.h"
+
+/** default max. number of packets in flight */
+#define LOADGEN_DEFAULT_WINDOW		64
+
+/** default milliseconds after which a packet without ack is lost */
+#define LOADGEN_DEFAULT_TIMEOUT		1000
+
+struct loadgen_config {
+	// destination, packet payload size and the ID of the first packet
+	packet_dest_t dest;
+	unsigned int payload;
+	packet_id_t first_id;
+
+	// packet format version, 2 is negotiated with the node
+	int version;
+
+	// closed loop: a new packet is sent whenever one of window packets
+	// in flight on a connection was acked or lost
+	unsigned int window;
+
+	// open loop: packets per second over all connections, sent at fixed
+	// intervals as long as the window allows. 0 for closed loop
+	unsigned int rate;
+
+	// milliseconds to send packets and until a packet counts as lost
+	unsigned int duration;
+	unsigned int timeout;
+};
+
+struct loadgen_stats {
+	unsigned long sent;
+	unsigned long acked;
+	unsigned long lost;
+
+	// acks for IDs not in flight: duplicates or acks after the timeout
+	unsigned long unknown;
+
+	// microseconds from the first packet sent to the last ack or timeout
+	ustime_t elapsed;
+
+	// round trip time of the acked packets, in microseconds. Open loop
+	// measures from when the packet was due, a node falling behind isn't
+	// hidden by packets sent late
+	hist_t latency;
+};
+
+/**
+ * initializes a configuration with the defaults: destination 1 ('z'),
+ * 100 bytes payload, version 1, closed loop, 5 seconds
+ * @param cfg the configuration
+ */
+void loadgen_defaults(struct loadgen_config *cfg);
+
+/**
+ * offers version 2 to a node and switches if it agrees, a blocking
+ * exchange of version 1 frames on a fresh connection
+ * @param fd the connected socket
+ * @param max_payload receives the node's max. payload
+ * @return 0 on success, -EPROTO if the node stays at version 1,
+ * error code (negative) otherwise
+ */
+int loadgen_negotiate_v2(int fd, unsigned int *max_payload);
+
+/**
+ * connects to the nodes and sends packets for the configured duration,
+ * round robin over the connections, then waits for the outstanding acks
+ * up to the timeout. The IDs count up from first_id over all connections.
+ * @param hosts the nodes
+ * @param num_hosts number of nodes, one connection each
+ * @param cfg the configuration
+ * @param stats receives the results, must be all zero
+ * @return 0 on success, error code (negative) otherwise
+ */
+int loadgen_run(struct sockaddr_in *hosts, unsigned int num_hosts,
+	const struct loadgen_config *cfg, struct loadgen_stats *stats);
+
+#endif
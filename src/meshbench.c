@@ -0,0 +1,493 @@
+/**
+ * meshbench - starts a mesh of meshy nodes on loopback, injects traffic at
+ * the source and reports throughput, latency, duplicates and CPU usage
+ *
+ * Written by agent
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <libgen.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+
+#include "lib/net.h"
+#include "lib/utils.h"
+#include "lib/hist.h"
+
+#include "packet.h"
+#include "loadgen.h"
+
+/** max. number of nodes */
+#define MESHBENCH_MAX_NODES		256
+
+/** max. number of meshy arguments */
+#define MESHBENCH_MAX_ARGS		32
+
+/** milliseconds to wait for the nodes to listen */
+#define MESHBENCH_START_WAIT	3000
+
+/** milliseconds to let the nodes connect after sending the neighbors */
+#define MESHBENCH_SETTLE_TIME	500
+
+enum topology {
+	topo_line,
+	topo_ring,
+	topo_grid,
+	topo_random,
+};
+
+static const char *topology_names[] = {
+	[topo_line] = "line",
+	[topo_ring] = "ring",
+	[topo_grid] = "grid",
+	[topo_random] = "random",
+};
+
+struct node {
+	pid_t pid;
+	int port;
+	char sock[108];
+
+	// from the metrics socket before stopping the node
+	unsigned long received;
+	unsigned long duplicates;
+	unsigned long delivered;
+
+	// user and system CPU time in seconds, from wait4()
+	double cpu;
+};
+
+struct edge {
+	unsigned int a, b;
+};
+
+static struct node nodes[MESHBENCH_MAX_NODES];
+static unsigned int num_nodes = 4;
+
+static struct edge *edges;
+static unsigned int num_edges;
+
+static void usage()
+{
+	printf("Usage: meshbench [-n <nodes>] [-T line|ring|grid|random] [-d <extra-degree>]\n");
+	printf("                 [-S <seed>] [-p <base-port>] [-t <seconds>] [-w <window>]\n");
+	printf("                 [-s <payload>] [-1] [-m <meshy>] [-x <meshy-args>]\n");
+	printf("	-n: Number of nodes, 2 to %d (default: 4)\n", MESHBENCH_MAX_NODES);
+	printf("	-T: Topology (default: line). The source is the first node, the\n");
+	printf("	    destination the last one, the middle one for a ring\n");
+	printf("	-d: Random topology: average number of extra links per node on top\n");
+	printf("	    of a random spanning tree (default: 1)\n");
+	printf("	-S: Random topology: seed (default: 1)\n");
+	printf("	-p: Port of the first node, the others follow (default: 5000)\n");
+	printf("	-t: Seconds to send packets (default: 5)\n");
+	printf("	-w: Max. number of packets in flight (default: %d)\n", LOADGEN_DEFAULT_WINDOW);
+	printf("	-s: Payload size in bytes (default: 100)\n");
+	printf("	-1: Use packet format version 1 instead of 2: 16 bit IDs repeating\n");
+	printf("	    every 65536 packets, payloads up to %d bytes\n", PACKET_CONTENT_SIZE);
+	printf("	-m: Path of the meshy binary (default: meshy next to meshbench)\n");
+	printf("	-x: Additional arguments for all nodes, e.g. \"-e 2 -k 50\"\n");
+	printf("Prints one line of JSON with the results to stdout.\n");
+	exit(1);
+}
+
+static int edge_add(unsigned int a, unsigned int b)
+{
+	if (a == b)
+		return 0;
+
+	for (unsigned int i = 0; i < num_edges; i++) {
+		if ((edges[i].a == a && edges[i].b == b) || (edges[i].a == b && edges[i].b == a))
+			return 0;
+	}
+
+	edges[num_edges].a = a;
+	edges[num_edges].b = b;
+	num_edges++;
+	return 1;
+}
+
+/* builds the links, returns the index of the destination node */
+static unsigned int topology_build(enum topology topo, unsigned int degree)
+{
+	unsigned int n = num_nodes, cols, extra;
+
+	switch (topo) {
+	case topo_line:
+		for (unsigned int i = 0; i + 1 < n; i++)
+			edge_add(i, i + 1);
+		return n - 1;
+
+	case topo_ring:
+		for (unsigned int i = 0; i < n; i++)
+			edge_add(i, (i + 1) % n);
+		return n / 2;
+
+	case topo_grid:
+		for (cols = 1; cols * cols < n; cols++)
+			;
+		for (unsigned int i = 0; i < n; i++) {
+			if ((i + 1) % cols && i + 1 < n)
+				edge_add(i, i + 1);
+			if (i + cols < n)
+				edge_add(i, i + cols);
+		}
+		return n - 1;
+
+	case topo_random:
+		// a random spanning tree keeps the mesh connected
+		for (unsigned int i = 1; i < n; i++)
+			edge_add(i, random() % i);
+
+		// extra links, unless the graph is complete
+		extra = n * degree / 2;
+		while (extra && num_edges < n * (n - 1) / 2)
+			extra -= edge_add(random() % n, random() % n);
+		return n - 1;
+	}
+
+	return n - 1;
+}
+
+static void nodes_stop()
+{
+	struct rusage ru;
+	int status;
+
+	for (unsigned int i = 0; i < num_nodes; i++) {
+		if (nodes[i].pid <= 0)
+			continue;
+
+		kill(nodes[i].pid, SIGTERM);
+		if (wait4(nodes[i].pid, &status, 0, &ru) == nodes[i].pid) {
+			nodes[i].cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+				ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+		}
+		nodes[i].pid = 0;
+		unlink(nodes[i].sock);
+	}
+}
+
+static int node_start(unsigned int idx, const char *meshy, const char *role, char *extra)
+{
+	char *args[MESHBENCH_MAX_ARGS + 8];
+	char port[16];
+	unsigned int num = 0;
+	pid_t pid;
+	char *tok;
+
+	snprintf(port, sizeof(port), "%d", nodes[idx].port);
+	snprintf(nodes[idx].sock, sizeof(nodes[idx].sock), "/tmp/meshbench.%d.%u.sock",
+		(int) getpid(), idx);
+
+	args[num++] = (char *) meshy;
+	args[num++] = port;
+	if (role)
+		args[num++] = (char *) role;
+	args[num++] = "-M";
+	args[num++] = nodes[idx].sock;
+	for (tok = strtok(extra, " "); tok && num < MESHBENCH_MAX_ARGS; tok = strtok(NULL, " "))
+		args[num++] = tok;
+	args[num] = NULL;
+
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+
+	if (pid == 0) {
+		// the destination writes the payloads to stdout
+		if (!freopen("/dev/null", "w", stdout) || !freopen("/dev/null", "w", stderr))
+			_exit(1);
+		execv(meshy, args);
+		_exit(127);
+	}
+
+	nodes[idx].pid = pid;
+	return 0;
+}
+
+static struct sockaddr_in node_addr(unsigned int idx)
+{
+	struct sockaddr_in addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(nodes[idx].port);
+	return addr;
+}
+
+/* waits until a node accepts connections */
+static int node_wait(unsigned int idx)
+{
+	struct sockaddr_in addr = node_addr(idx);
+	ustime_t deadline = time_monotonic_us() + MESHBENCH_START_WAIT * 1000;
+	int fd;
+
+	while (time_monotonic_us() < deadline) {
+		fd = net_connect(&addr);
+		if (fd >= 0) {
+			close(fd);
+			return 0;
+		}
+		usleep(10000);
+	}
+
+	return -ETIMEDOUT;
+}
+
+/* tells node a to connect to node b */
+static int node_link(unsigned int a, unsigned int b)
+{
+	struct sockaddr_in addr = node_addr(a), neigh = node_addr(b);
+	packet_t *packet;
+	ssize_t len;
+	int fd;
+
+	fd = net_connect(&addr);
+	if (fd < 0)
+		return -ECONNREFUSED;
+
+	packet = packet_cre_neighbor(&neigh);
+	if (!packet) {
+		close(fd);
+		return -ENOMEM;
+	}
+	len = send(fd, packet->raw, PACKET_SIZE, MSG_NOSIGNAL);
+	packet_put(packet);
+	close(fd);
+
+	return len == PACKET_SIZE ? 0 : -EIO;
+}
+
+/* reads the counters of a node from its metrics socket */
+static int node_scrape(unsigned int idx)
+{
+	struct sockaddr_un addr;
+	char line[256], name[128];
+	unsigned long value;
+	FILE *f;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, nodes[idx].sock, sizeof(addr.sun_path) - 1);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -errno;
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -errno;
+	}
+	shutdown(fd, SHUT_WR);
+
+	f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%127s %lu", name, &value) != 2)
+			continue;
+		if (!strcmp(name, "meshy_packets_received_total"))
+			nodes[idx].received = value;
+		else if (!strcmp(name, "meshy_duplicates_total"))
+			nodes[idx].duplicates = value;
+		else if (!strcmp(name, "meshy_delivered_total"))
+			nodes[idx].delivered = value;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static void report(enum topology topo, const struct loadgen_config *cfg,
+	const struct loadgen_stats *stats, unsigned int dest)
+{
+	unsigned long received = 0, duplicates = 0;
+	double secs = stats->elapsed / 1e6;
+
+	for (unsigned int i = 0; i < num_nodes; i++) {
+		received += nodes[i].received;
+		duplicates += nodes[i].duplicates;
+	}
+
+	printf("{\"topology\":\"%s\",\"nodes\":%u,\"links\":%u,\"version\":%d,\"payload\":%u,"
+		"\"window\":%u,\"seconds\":%.3f,\"sent\":%lu,\"acked\":%lu,\"lost\":%lu,"
+		"\"unknown_acks\":%lu,\"delivered\":%lu,\"msgs_per_sec\":%.1f,",
+		topology_names[topo], num_nodes, num_edges, cfg->version, cfg->payload,
+		cfg->window, secs, stats->sent, stats->acked, stats->lost, stats->unknown,
+		nodes[dest].delivered, secs > 0 ? stats->acked / secs : 0.0);
+	printf("\"latency_us\":{\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu},",
+		(unsigned long long) hist_quantile(&stats->latency, 0.5),
+		(unsigned long long) hist_quantile(&stats->latency, 0.9),
+		(unsigned long long) hist_quantile(&stats->latency, 0.99),
+		(unsigned long long) hist_quantile(&stats->latency, 0.999),
+		(unsigned long long) stats->latency.max);
+	printf("\"packets_received\":%lu,\"duplicates\":%lu,\"duplicate_ratio\":%.4f,\"node_cpu_s\":[",
+		received, duplicates, received ? (double) duplicates / received : 0.0);
+	for (unsigned int i = 0; i < num_nodes; i++)
+		printf("%s%.3f", i ? "," : "", nodes[i].cpu);
+	printf("]}\n");
+
+	fprintf(stderr, "%s, %u nodes: %.0f msgs/s, p50 %llu us, p99 %llu us, %lu lost, "
+		"%.1f%% duplicates\n", topology_names[topo], num_nodes,
+		secs > 0 ? stats->acked / secs : 0.0,
+		(unsigned long long) hist_quantile(&stats->latency, 0.5),
+		(unsigned long long) hist_quantile(&stats->latency, 0.99),
+		stats->lost, received ? 100.0 * duplicates / received : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct loadgen_config cfg;
+	struct loadgen_stats *stats;
+	struct sockaddr_in addr;
+	enum topology topo = topo_line;
+	unsigned int degree = 1, dest;
+	unsigned int seed = 1;
+	int port = 5000;
+	char meshy[1024];
+	char *extra = "";
+	char *extra_copy;
+	int optchar, err;
+
+	loadgen_defaults(&cfg);
+	cfg.version = 2;
+	snprintf(meshy, sizeof(meshy), "%s/meshy", dirname(strdup(argv[0])));
+
+	while ((optchar = getopt(argc, argv, "hn:T:d:S:p:t:w:s:1m:x:")) != -1) {
+		switch (optchar) {
+		case 'n':
+			num_nodes = atoi(optarg);
+			if (num_nodes < 2 || num_nodes > MESHBENCH_MAX_NODES)
+				usage();
+			break;
+
+		case 'T':
+			for (topo = topo_line; topo <= topo_random; topo++) {
+				if (!strcmp(optarg, topology_names[topo]))
+					break;
+			}
+			if (topo > topo_random)
+				usage();
+			break;
+
+		case 'd':
+			degree = atoi(optarg);
+			break;
+
+		case 'S':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'p':
+			port = atoi(optarg);
+			if (port <= 0)
+				usage();
+			break;
+
+		case 't':
+			if (atof(optarg) <= 0)
+				usage();
+			cfg.duration = atof(optarg) * 1000;
+			break;
+
+		case 'w':
+			cfg.window = atoi(optarg);
+			break;
+
+		case 's':
+			cfg.payload = atoi(optarg);
+			break;
+
+		case '1':
+			cfg.version = 1;
+			break;
+
+		case 'm':
+			snprintf(meshy, sizeof(meshy), "%s", optarg);
+			break;
+
+		case 'x':
+			extra = optarg;
+			break;
+
+		case 'h':
+		case '?':
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (port + num_nodes > 65535)
+		usage();
+	if (cfg.version < 2 && cfg.payload > PACKET_CONTENT_SIZE) {
+		fprintf(stderr, "Payloads above %d bytes need version 2\n", PACKET_CONTENT_SIZE);
+		return 1;
+	}
+
+	// the nodes going away must not kill us
+	signal(SIGPIPE, SIG_IGN);
+	srandom(seed);
+
+	edges = calloc(num_nodes * num_nodes, sizeof(*edges));
+	stats = calloc(1, sizeof(*stats));
+	if (!edges || !stats)
+		return 1;
+	dest = topology_build(topo, degree);
+
+	// start the nodes: the source, the destination and normal ones
+	for (unsigned int i = 0; i < num_nodes; i++) {
+		extra_copy = strdup(extra);
+		nodes[i].port = port + i;
+		err = node_start(i, meshy, i == 0 ? "-q" : i == dest ? "-z" : NULL, extra_copy);
+		free(extra_copy);
+		if (check_error(err))
+			goto out_stop;
+	}
+
+	for (unsigned int i = 0; i < num_nodes; i++) {
+		err = node_wait(i);
+		if (err) {
+			fprintf(stderr, "Node %u (%s, port %d) didn't start\n", i, meshy, nodes[i].port);
+			goto out_stop;
+		}
+	}
+
+	for (unsigned int i = 0; i < num_edges; i++) {
+		err = node_link(edges[i].a, edges[i].b);
+		if (check_error(err))
+			goto out_stop;
+	}
+	usleep(MESHBENCH_SETTLE_TIME * 1000);
+
+	addr = node_addr(0);
+	err = loadgen_run(&addr, 1, &cfg, stats);
+	if (check_error(err))
+		goto out_stop;
+
+	for (unsigned int i = 0; i < num_nodes; i++)
+		check_error(node_scrape(i));
+	nodes_stop();
+
+	report(topo, &cfg, stats, dest);
+
+out_stop:
+	nodes_stop();
+	free(stats);
+	free(edges);
+	return err ? 1 : 0;
+}
@@ -16,23 +16,57 @@
 
 #include "lib/utils.h"
 #include "lib/net.h"
+#include "lib/ring.h"
+#include "lib/log.h"
 
 #include "connection.h"
 #include "receiver.h"
 #include "sender.h"
 #include "idcache.h"
+#include "dupfilter.h"
 #include "routing.h"
-
-/** number of sender threads */
-#define NUM_SENDERS		3
+#include "evloop.h"
+#include "uring.h"
+#include "sendq.h"
+#include "metrics.h"
 
 static void usage()
 {
-	printf("Usage: meshy <port> [-z|-q] [-v] [-t <route-timeout]\n");
+	printf("Usage: meshy <port> [-z|-q|-d <dest>] [-v] [-l] [-t <route-timeout] [-e <io-threads>]\n");
+	printf("             [-s <sendq-size>] [-k <cork-usec>] [-u]\n");
+	printf("             [-c <id-cache-size>] [-b <id-hash-slots>] [-w <dup-window>] [-r <dup-rate>]\n");
+	printf("             [-m <max-payload>] [-p <senders>] [-P <max-senders>] [-a <cpus>]\n");
+	printf("             [-M <metrics-socket>]\n");
 	printf("	-z: Node is the 'destination'\n");
 	printf("	-q: Node is the 'source'\n");
+	printf("	-d: Node is the destination with ID <dest>, 'Q' is 0 and 'Z' is 1\n");
 	printf("	-v: Enable verbose mode\n");
+	printf("	-l: Write verbose messages synchronously instead of by a log thread\n");
 	printf("	-t: Sets the routing timeout in milliseconds\n");
+	printf("	-e: Use the epoll event loop with <io-threads> threads instead of\n");
+	printf("	    one receiver thread per connection\n");
+	printf("	-s: Sets the number of send queue entries, a power of two\n");
+	printf("	-k: Sets the corking window in microseconds: wait that long for more\n");
+	printf("	    packets to write them at once\n");
+	printf("	-u: Use io_uring, falls back to -e / threads if not supported\n");
+	printf("	-c: Sets the number of packet IDs remembered for duplicate detection\n");
+	printf("	    and acks (default: %d)\n", IDCACHE_DEFAULT_SIZE);
+	printf("	-b: Sets the number of ID cache hash slots, a power of two larger\n");
+	printf("	    than the ID cache size (default: twice the size)\n");
+	printf("	-w: Sets how long packet IDs are remembered to drop duplicates, in\n");
+	printf("	    milliseconds (default: %d)\n", DUPFILTER_DEFAULT_WINDOW);
+	printf("	-r: Sets the packets per second the duplicate filter is sized for\n");
+	printf("	    (default: %d)\n", DUPFILTER_DEFAULT_RATE);
+	printf("	-m: Sets the max. payload size of version 2 packets accepted, in bytes\n");
+	printf("	    (default: %d)\n", PACKET_DEFAULT_MAX_PAYLOAD);
+	printf("	-p: Sets the number of sender threads always running, 0 for one per\n");
+	printf("	    CPU (default: %d)\n", SENDER_DEFAULT_MIN);
+	printf("	-P: Sets the max. number of sender threads started while the send\n");
+	printf("	    queue fills up, 0 for one per CPU (default)\n");
+	printf("	-a: Pins the sender threads to the CPUs <cpus>, a list like 0-3,8\n");
+	printf("	    or node<N> for the CPUs of NUMA node N\n");
+	printf("	-M: Serves the metrics in the Prometheus text format on the UNIX\n");
+	printf("	    socket <metrics-socket>\n");
 	exit(1);
 }
 
@@ -42,6 +76,17 @@ int main(int argc, char *argv[])
 	int optchar, err;
 	int port = 3333;
 	int timeout = -1;
+	int io_threads = 0;
+	int use_uring = 0;
+	int sendq_size = SEND_QUEUE_SIZE;
+	int idcache_size = IDCACHE_DEFAULT_SIZE;
+	int idcache_slots = 0;
+	int dup_window = DUPFILTER_DEFAULT_WINDOW;
+	int dup_rate = DUPFILTER_DEFAULT_RATE;
+	int senders = SENDER_DEFAULT_MIN;
+	int max_senders = 0;
+	int sync_log = 0;
+	char *metrics_path = NULL;
 	char dbg_prefix[50];
 	char *role_str = " ";
 	char *verbose;
@@ -57,26 +102,110 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	while ((optchar = getopt(argc-has_port, argv+has_port, "hqzvt:")) != -1) {
+	while ((optchar = getopt(argc-has_port, argv+has_port, "hqzvld:ut:e:s:k:c:b:w:r:m:p:P:a:M:")) != -1) {
 		switch (optchar) {
 		case 'z':
-			node_role = dest_node;
+			receiver_set_role(dest_node, 1);
 			role_str = "Z";
 			break;
 
 		case 'q':
-			node_role = src_node;
+			receiver_set_role(src_node, 0);
 			role_str = "Q";
 			break;
 
+		case 'd':
+			if (!isdigit(optarg[0]))
+				usage();
+			receiver_set_role(dest_node, strtoul(optarg, NULL, 10));
+			role_str = "D";
+			break;
+
 		case 'v':
 			set_debug(1);
 			break;
 
+		case 'l':
+			sync_log = 1;
+			break;
+
 		case 't':
 			timeout = atoi(optarg);
 			break;
 
+		case 'e':
+			io_threads = atoi(optarg);
+			if (io_threads <= 0)
+				usage();
+			break;
+
+		case 's':
+			sendq_size = atoi(optarg);
+			if (!ring_capacity_valid(sendq_size))
+				usage();
+			break;
+
+		case 'k':
+			connection_set_cork(atoi(optarg));
+			break;
+
+		case 'u':
+			use_uring = 1;
+			break;
+
+		case 'c':
+			idcache_size = atoi(optarg);
+			if (idcache_size <= 0)
+				usage();
+			break;
+
+		case 'b':
+			idcache_slots = atoi(optarg);
+			if (!ring_capacity_valid(idcache_slots))
+				usage();
+			break;
+
+		case 'w':
+			dup_window = atoi(optarg);
+			if (dup_window <= 0)
+				usage();
+			break;
+
+		case 'r':
+			dup_rate = atoi(optarg);
+			if (dup_rate <= 0)
+				usage();
+			break;
+
+		case 'm':
+			if (atoi(optarg) < PACKET_CONTENT_SIZE || packet_set_max_payload(atoi(optarg)))
+				usage();
+			break;
+
+		case 'p':
+			senders = atoi(optarg);
+			if (senders < 0)
+				usage();
+			break;
+
+		case 'P':
+			max_senders = atoi(optarg);
+			if (max_senders < 0)
+				usage();
+			break;
+
+		case 'a':
+			err = sender_set_cpus(optarg);
+			if (err == -EINVAL)
+				usage();
+			if (check_error(err))
+				return 1;
+			break;
+
+		case 'M':
+			metrics_path = optarg;
+			break;
+
 		case 'h':
 		case '?':
 		default:
@@ -98,27 +227,73 @@ int main(int argc, char *argv[])
 			dbg("Invalid route timeout; ignored\n");
 		} else {
 			dbg("Setting route timeout to %d milliseconds\n", timeout);
-			route_set_timeout(atoi(optarg));
+			route_set_timeout(timeout);
 		}
 	}
 
 	sprintf(dbg_prefix, "Node %s % 5d: ", role_str, port);
 	debug_prefix(dbg_prefix);
 
+	// verbose messages are formatted and written by the log thread
+	if (debug && !sync_log) {
+		err = log_initialize();
+		if (check_error(err))
+			return 1;
+	}
+
 	// initialize
-	err = idcache_initialize();
+	err = idcache_initialize(idcache_size, idcache_slots);
+	if (err == -EINVAL)
+		usage();
 	if (check_error(err))
 		return 1;
 
+	err = dupfilter_initialize(dup_window, dup_rate);
+	if (err == -EINVAL)
+		usage();
+	if (check_error(err))
+		return 1;
+
+	err = sendq_initialize(sendq_size);
+	if (check_error(err))
+		return 1;
+
+	if (metrics_path) {
+		err = metrics_serve(metrics_path);
+		if (check_error(err))
+			return 1;
+	}
+
+	if (io_threads) {
+		dbg("Creating %d event loop thread(s)\n", io_threads);
+		err = evloop_initialize(io_threads);
+		if (check_error(err))
+			return 1;
+	}
+
 	int listenfd = net_listen(port);
 	if (check_error(listenfd))
 		exit(1);
 	dbg("Listening on port %d (fd: %d)\n", port, listenfd);
 
+	if (use_uring) {
+		err = uring_initialize();
+		if (err)
+			dbg("io_uring not supported (%d), not using it\n", err);
+		else
+			dbg("Using io_uring\n");
+	}
+
 	// create sender threads
-	dbg("Creating %d sender thread(s)\n", NUM_SENDERS);
-	for (unsigned int i = 0; i < NUM_SENDERS; i++)
-		sender_create();
+	err = sender_initialize(senders, max_senders);
+	if (check_error(err))
+		return 1;
+
+	// io_uring: the main thread runs the ring, accepting new connections
+	if (uring_enabled()) {
+		check_error(uring_run(listenfd));
+		exit(1);
+	}
 
 	// main loop: accept new connections
 	for (;;) {
@@ -146,7 +321,10 @@ int main(int argc, char *argv[])
 		connection_t *conn = connection_create(newfd, &addr);
 		if (conn) {
 			int err = receiver_create(conn);
-			check_error(err);
+			if (check_error(err)) {
+				connection_close(conn);
+				connection_release(conn);
+			}
 		} else {
 			dbg("Cannot allocate connection...");
 			shutdown(newfd, SHUT_RDWR);
@@ -0,0 +1,361 @@
+/**
+ * Metrics
+ *
+ * Blocks are never freed, the block of an exited thread is reused by the
+ * next new thread and keeps counting from where it was.
+ *
+ * Written by agent
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "lib/utils.h"
+#include "lib/net.h"
+#include "lib/log.h"
+
+#include "metrics.h"
+#include "connection.h"
+#include "sendq.h"
+#include "sender.h"
+#include "routing.h"
+#include "pktpool.h"
+
+/** milliseconds to wait for an HTTP request on the metrics socket */
+#define METRICS_REQUEST_WAIT	100
+
+struct metric_info {
+	const char *name;
+	const char *help;
+};
+
+static const struct metric_info metric_info[METRIC_COUNT] = {
+	[METRIC_PACKETS_RECEIVED] = { "meshy_packets_received_total", "Packets received" },
+	[METRIC_PACKETS_SENT] = { "meshy_packets_sent_total", "Packets written to connections" },
+	[METRIC_BYTES_SENT] = { "meshy_bytes_sent_total", "Bytes written to connections" },
+	[METRIC_DUPLICATES] = { "meshy_duplicates_total", "'C' packets dropped as duplicates" },
+	[METRIC_DELIVERED] = { "meshy_delivered_total", "'C' packets that reached this node as destination" },
+	[METRIC_ACKS_FORWARDED] = { "meshy_acks_forwarded_total", "'O' packets sent back towards the origin" },
+	[METRIC_ACKS_UNKNOWN] = { "meshy_acks_unknown_total", "'O' packets for unknown or already acked IDs" },
+	[METRIC_UNICAST] = { "meshy_unicast_total", "Packets sent to the routed next hop" },
+	[METRIC_BROADCAST] = { "meshy_broadcast_total", "Packets sent to all neighbors for lack of a route" },
+	[METRIC_SEND_FAILURES] = { "meshy_send_failures_total", "Packets that couldn't be queued to a connection" },
+	[METRIC_ROUTE_CHANGES] = { "meshy_route_changes_total", "Next hops chosen as new or faster route" },
+};
+
+static const struct metric_info metric_hist_info[METRIC_HIST_COUNT] = {
+	[METRIC_HIST_SENDQ_WAIT] = { "meshy_sendq_wait_microseconds", "Time packets waited in the send queue" },
+	[METRIC_HIST_ROUND_TRIP] = { "meshy_rtt_microseconds",
+		"Round trip time from receiving a packet to receiving its ack, all destinations" },
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+__thread struct metrics_block *metrics_cur;
+
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(blocks);
+static struct metrics_block fallback_block;
+
+static pthread_key_t block_key;
+static pthread_once_t block_key_once = PTHREAD_ONCE_INIT;
+
+static void block_destroy(void *arg)
+{
+	struct metrics_block *b = arg;
+
+	pthread_mutex_lock(&blocks_lock);
+	b->in_use = 0;
+	pthread_mutex_unlock(&blocks_lock);
+
+	metrics_cur = NULL;
+}
+
+static void block_key_create()
+{
+	pthread_key_create(&block_key, block_destroy);
+	list_add(&fallback_block.list_entry, &blocks);
+}
+
+struct metrics_block *metrics_block_get()
+{
+	struct metrics_block *b = NULL, *pos;
+
+	pthread_once(&block_key_once, block_key_create);
+
+	pthread_mutex_lock(&blocks_lock);
+	list_for_each_entry(pos, &blocks, list_entry) {
+		if (!pos->in_use && pos != &fallback_block) {
+			b = pos;
+			break;
+		}
+	}
+	if (!b && !posix_memalign((void **) &b, CACHELINE_SIZE, sizeof(*b))) {
+		memset(b, 0, sizeof(*b));
+		list_add(&b->list_entry, &blocks);
+	}
+	if (b)
+		b->in_use = 1;
+	pthread_mutex_unlock(&blocks_lock);
+
+	// counting in the shared block may lose increments, better than nothing
+	if (!b)
+		return &fallback_block;
+
+	metrics_cur = b;
+	pthread_setspecific(block_key, b);
+	return b;
+}
+
+void metrics_write_header(FILE *f, const char *name, const char *help, const char *type)
+{
+	fprintf(f, "# HELP %s %s\n", name, help);
+	fprintf(f, "# TYPE %s %s\n", name, type);
+}
+
+static void write_counter(FILE *f, const char *name, const char *help, unsigned long value)
+{
+	metrics_write_header(f, name, help, "counter");
+	fprintf(f, "%s %lu\n", name, value);
+}
+
+static void write_gauge(FILE *f, const char *name, const char *help, unsigned long value)
+{
+	metrics_write_header(f, name, help, "gauge");
+	fprintf(f, "%s %lu\n", name, value);
+}
+
+void metrics_write_summary(FILE *f, const char *name, const char *labels, const hist_t *h)
+{
+	const char *sep = labels ? "," : "";
+
+	if (!labels)
+		labels = "";
+
+	for (unsigned int i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+		fprintf(f, "%s{%s%squantile=\"%g\"} %llu\n", name, labels, sep, quantiles[i],
+			(unsigned long long) hist_quantile(h, quantiles[i]));
+
+	if (*labels) {
+		fprintf(f, "%s_sum{%s} %llu\n", name, labels, (unsigned long long) h->sum);
+		fprintf(f, "%s_count{%s} %lu\n", name, labels, h->count);
+	} else {
+		fprintf(f, "%s_sum %llu\n", name, (unsigned long long) h->sum);
+		fprintf(f, "%s_count %lu\n", name, h->count);
+	}
+}
+
+/* the counters of all connections, with the peer as label */
+static void write_connections(FILE *f, connection_snapshot_t *snap)
+{
+	char hoststr[INET_ADDRSTRLEN];
+	char labels[INET_ADDRSTRLEN + 16];
+	connection_t *conn;
+	hist_t *h;
+
+	metrics_write_header(f, "meshy_connection_packets_received_total",
+		"Packets received per connection", "counter");
+	for (unsigned int i = 0; i < snap->count; i++) {
+		conn = snap->conns[i];
+		fprintf(f, "meshy_connection_packets_received_total{peer=\"%s:%hu\"} %lu\n",
+			net_addr_str(connection_get_addr(conn), hoststr, sizeof(hoststr)),
+			connection_get_port(conn), atomic_load_relaxed(&conn->rx_packets));
+	}
+
+	metrics_write_header(f, "meshy_connection_packets_sent_total",
+		"Packets written per connection", "counter");
+	for (unsigned int i = 0; i < snap->count; i++) {
+		conn = snap->conns[i];
+		fprintf(f, "meshy_connection_packets_sent_total{peer=\"%s:%hu\"} %lu\n",
+			net_addr_str(connection_get_addr(conn), hoststr, sizeof(hoststr)),
+			connection_get_port(conn), atomic_load_relaxed(&conn->tx_packets));
+	}
+
+	metrics_write_header(f, "meshy_connection_queued_packets",
+		"Packets queued for writing per connection", "gauge");
+	for (unsigned int i = 0; i < snap->count; i++) {
+		conn = snap->conns[i];
+		fprintf(f, "meshy_connection_queued_packets{peer=\"%s:%hu\"} %u\n",
+			net_addr_str(connection_get_addr(conn), hoststr, sizeof(hoststr)),
+			connection_get_port(conn), connection_output_count(conn));
+	}
+
+	h = malloc(sizeof(*h));
+	if (!h)
+		return;
+
+	metrics_write_header(f, "meshy_connection_rtt_microseconds",
+		"Round trip time from receiving a packet to receiving its ack, per neighbor", "summary");
+	for (unsigned int i = 0; i < snap->count; i++) {
+		conn = snap->conns[i];
+		memset(h, 0, sizeof(*h));
+		hist_merge(h, &conn->latency);
+		snprintf(labels, sizeof(labels), "peer=\"%s:%hu\"",
+			net_addr_str(connection_get_addr(conn), hoststr, sizeof(hoststr)),
+			connection_get_port(conn));
+		metrics_write_summary(f, "meshy_connection_rtt_microseconds", labels, h);
+	}
+
+	free(h);
+}
+
+void metrics_write(FILE *f)
+{
+	unsigned long counters[METRIC_COUNT] = { 0 };
+	hist_t *hists;
+	struct metrics_block *b;
+	struct pktpool_stats pool;
+	connection_snapshot_t *snap;
+
+	hists = calloc(METRIC_HIST_COUNT, sizeof(*hists));
+	if (!hists)
+		return;
+
+	pthread_once(&block_key_once, block_key_create);
+
+	pthread_mutex_lock(&blocks_lock);
+	list_for_each_entry(b, &blocks, list_entry) {
+		for (unsigned int i = 0; i < METRIC_COUNT; i++)
+			counters[i] += atomic_load_relaxed(&b->counters[i]);
+		for (unsigned int i = 0; i < METRIC_HIST_COUNT; i++)
+			hist_merge(&hists[i], &b->hists[i]);
+	}
+	pthread_mutex_unlock(&blocks_lock);
+
+	for (unsigned int i = 0; i < METRIC_COUNT; i++)
+		write_counter(f, metric_info[i].name, metric_info[i].help, counters[i]);
+
+	for (unsigned int i = 0; i < METRIC_HIST_COUNT; i++) {
+		metrics_write_header(f, metric_hist_info[i].name, metric_hist_info[i].help, "summary");
+		metrics_write_summary(f, metric_hist_info[i].name, NULL, &hists[i]);
+	}
+	free(hists);
+	route_write_metrics(f);
+
+	snap = connection_snapshot_get();
+	write_gauge(f, "meshy_connections", "Open connections", snap->count);
+	write_gauge(f, "meshy_sendq_packets", "Packets in the send queue", sendq_size());
+	write_gauge(f, "meshy_sender_threads", "Sender threads running", sender_count());
+	write_counter(f, "meshy_log_dropped_total", "Debug messages dropped on full log rings",
+		log_dropped());
+
+	pktpool_get_stats(&pool);
+	write_counter(f, "meshy_pktpool_allocs_total", "Packet buffers handed out by the pool", pool.allocs);
+	write_counter(f, "meshy_pktpool_frees_total", "Packet buffers returned to the pool", pool.frees);
+	write_gauge(f, "meshy_pktpool_in_use", "Packet buffers handed out now", pool.in_use);
+	write_gauge(f, "meshy_pktpool_depot", "Packet buffers in the shared depot", pool.depot);
+	write_gauge(f, "meshy_pktpool_slabs", "Slabs allocated by the pool, it never shrinks", pool.slabs);
+	write_gauge(f, "meshy_pktpool_objects",
+		"Packet buffers allocated from the system: the high-water mark", pool.objects);
+	write_connections(f, snap);
+	connection_snapshot_put(snap);
+}
+
+/* answers one client, with HTTP headers if it sent a request */
+static void metrics_answer(int fd)
+{
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN,
+	};
+	char req[4], buf_req[512];
+	char *buf = NULL;
+	size_t size = 0, off = 0;
+	ssize_t len = 0;
+	FILE *f;
+
+	if (poll(&pfd, 1, METRICS_REQUEST_WAIT) == 1)
+		len = recv(fd, req, sizeof(req), MSG_PEEK);
+
+	// formatted into memory first, sent without SIGPIPE if the client left
+	f = open_memstream(&buf, &size);
+	if (!f)
+		return;
+	if (len == sizeof(req) && !memcmp(req, "GET ", 4))
+		fprintf(f, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n");
+	metrics_write(f);
+	fclose(f);
+
+	while (off < size) {
+		len = send(fd, buf + off, size - off, MSG_NOSIGNAL);
+		if (len <= 0)
+			break;
+		off += len;
+	}
+	free(buf);
+
+	// read what's left of the request, closing with unread data resets the connection
+	shutdown(fd, SHUT_WR);
+	while (poll(&pfd, 1, METRICS_REQUEST_WAIT) == 1 && recv(fd, buf_req, sizeof(buf_req), 0) > 0)
+		;
+}
+
+static void *metrics_thread(void *arg)
+{
+	int listenfd = (intptr_t) arg;
+	int fd;
+
+	for (;;) {
+		fd = accept(listenfd, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			check_error(-errno);
+			break;
+		}
+		metrics_answer(fd);
+		close(fd);
+	}
+
+	close(listenfd);
+	return NULL;
+}
+
+int metrics_serve(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	pthread_t thr;
+	int fd, err;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	// replace a stale socket, but nothing else
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode))
+			return -EEXIST;
+		unlink(path);
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -errno;
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 10) < 0) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	err = pthread_create(&thr, NULL, metrics_thread, (void *) (intptr_t) fd);
+	if (err) {
+		close(fd);
+		return -err;
+	}
+	pthread_detach(thr);
+
+	dbg("Serving metrics on %s\n", path);
+	return 0;
+}
@@ -0,0 +1,124 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+/**
+ * Metrics - counters and latency histograms of the node. Each thread counts
+ * in its own cache line aligned block, without atomic read-modify-write.
+ * The blocks are summed up when read: by metrics_write() in the Prometheus
+ * text format, served on a UNIX socket by metrics_serve().
+ *
+ * Written by agent
+ */
+
+#include <stdio.h>
+
+#include "lib/hist.h"
+#include "lib/list.h"
+
+/** the counters, see metric_info in metrics.c for names and help texts */
+enum metric {
+	METRIC_PACKETS_RECEIVED,
+	METRIC_PACKETS_SENT,
+	METRIC_BYTES_SENT,
+	METRIC_DUPLICATES,
+	METRIC_DELIVERED,
+	METRIC_ACKS_FORWARDED,
+	METRIC_ACKS_UNKNOWN,
+	METRIC_UNICAST,
+	METRIC_BROADCAST,
+	METRIC_SEND_FAILURES,
+	METRIC_ROUTE_CHANGES,
+	METRIC_COUNT
+};
+
+/** the histograms, values in microseconds */
+enum metric_hist {
+	METRIC_HIST_SENDQ_WAIT,
+	METRIC_HIST_ROUND_TRIP,
+	METRIC_HIST_COUNT
+};
+
+/** per-thread block */
+struct metrics_block {
+	unsigned long counters[METRIC_COUNT];
+	hist_t hists[METRIC_HIST_COUNT];
+	int in_use;
+	list_head_t list_entry;
+} __cacheline_aligned;
+
+extern __thread struct metrics_block *metrics_cur;
+
+/**
+ * returns the block of the calling thread, allocating one on first use
+ * @return the block, a shared fallback block if allocation failed
+ */
+struct metrics_block *metrics_block_get();
+
+/**
+ * adds to a counter
+ * @param m the counter
+ * @param n the amount to add
+ */
+static inline void metrics_add(enum metric m, unsigned long n)
+{
+	struct metrics_block *b = metrics_cur ? metrics_cur : metrics_block_get();
+
+	atomic_store_relaxed(&b->counters[m], b->counters[m] + n);
+}
+
+/**
+ * increments a counter
+ * @param m the counter
+ */
+static inline void metrics_inc(enum metric m)
+{
+	metrics_add(m, 1);
+}
+
+/**
+ * records a value in a histogram
+ * @param h the histogram
+ * @param usec the value in microseconds
+ */
+static inline void metrics_record(enum metric_hist h, uint64_t usec)
+{
+	struct metrics_block *b = metrics_cur ? metrics_cur : metrics_block_get();
+
+	hist_record(&b->hists[h], usec);
+}
+
+/**
+ * writes the help and type lines of a metric
+ * @param f the stream to write to
+ * @param name the metric name
+ * @param help the help text
+ * @param type the type: counter, gauge or summary
+ */
+void metrics_write_header(FILE *f, const char *name, const char *help, const char *type);
+
+/**
+ * writes the p50, p90, p99 and p999 quantiles, sum and count of a histogram
+ * as a summary, after metrics_write_header()
+ * @param f the stream to write to
+ * @param name the metric name
+ * @param labels the labels like 'dest="1"', NULL for none
+ * @param h the histogram
+ */
+void metrics_write_summary(FILE *f, const char *name, const char *labels, const hist_t *h);
+
+/**
+ * writes all metrics in the Prometheus text exposition format
+ * @param f the stream to write to
+ */
+void metrics_write(FILE *f);
+
+/**
+ * starts a thread serving the metrics on a UNIX socket: each connection
+ * gets the current metrics, as HTTP response if it sent a GET request
+ * @param path the path of the socket, an existing socket is replaced
+ * @return 0 on success, -EEXIST if something other than a socket is at
+ * the path, error code (negative) otherwise
+ */
+int metrics_serve(const char *path);
+
+#endif
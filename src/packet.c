@@ -6,27 +6,232 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+#include "lib/atomic.h"
+
 #include "packet.h"
+#include "pktpool.h"
+
+/*
+ * a packet buffer: the packet (the version 1 frame) followed by the
+ * reference counter and the fields of version 2, fits into one pool object.
+ * Payloads larger than the version 1 content are allocated separately.
+ */
+struct packet_buf {
+	packet_t packet;
+	unsigned int refs;
+	unsigned int len;
+	packet_id_t id;
+	char *payload;
+	packet_dest_t dest;
+};
+
+unsigned int packet_max_payload = PACKET_DEFAULT_MAX_PAYLOAD;
+
+typedef char packet_buf_fits_pool_obj[sizeof(struct packet_buf) <= PKTPOOL_OBJ_SIZE ? 1 : -1];
+
+static inline struct packet_buf *to_buf(packet_t *pack)
+{
+	return (struct packet_buf *) pack;
+}
 
 packet_t *packet_alloc()
 {
-	return calloc(1, PACKET_SIZE);
+	struct packet_buf *buf = pktpool_alloc();
+	if (!buf)
+		return NULL;
+	memset(&buf->packet, 0, PACKET_SIZE);
+	buf->refs = 1;
+	buf->len = PACKET_CONTENT_SIZE;
+	buf->id = 0;
+	buf->payload = NULL;
+	buf->dest = 0;
+	return &buf->packet;
+}
+
+packet_t *packet_alloc_payload(unsigned int len)
+{
+	packet_t *pack = packet_alloc();
+	struct packet_buf *buf;
+
+	if (!pack)
+		return NULL;
+
+	buf = to_buf(pack);
+	buf->len = len;
+	if (len > PACKET_CONTENT_SIZE) {
+		buf->payload = calloc(1, len);
+		if (!buf->payload) {
+			pktpool_free(buf);
+			return NULL;
+		}
+	}
+	return pack;
+}
+
+packet_t *packet_get(packet_t *pack)
+{
+	atomic_inc(&to_buf(pack)->refs);
+	return pack;
+}
+
+int packet_is_shared(packet_t *pack)
+{
+	return atomic_load_acquire(&to_buf(pack)->refs) > 1;
+}
+
+void packet_put(packet_t *pack)
+{
+	struct packet_buf *buf;
+
+	if (!pack)
+		return;
+
+	// the last reference doesn't need the atomic operation
+	buf = to_buf(pack);
+	if (atomic_load_acquire(&buf->refs) == 1 || atomic_sub_return(&buf->refs, 1) == 0) {
+		free(buf->payload);
+		pktpool_free(buf);
+	}
+}
+
+packet_id_t packet_get_id(packet_t *pack)
+{
+	return to_buf(pack)->id;
+}
+
+void packet_set_id(packet_t *pack, packet_id_t id)
+{
+	to_buf(pack)->id = id;
+	pack->packet.id = htons((unsigned short) id);
+}
+
+packet_dest_t packet_get_dest(packet_t *pack)
+{
+	return to_buf(pack)->dest;
+}
+
+void packet_set_dest(packet_t *pack, packet_dest_t dest)
+{
+	to_buf(pack)->dest = dest;
+	pack->packet.dest = dest;
+}
+
+char *packet_get_payload(packet_t *pack)
+{
+	struct packet_buf *buf = to_buf(pack);
+	return buf->payload ? buf->payload : pack->packet.content;
+}
+
+unsigned int packet_get_len(packet_t *pack)
+{
+	return to_buf(pack)->len;
 }
 
-packet_t *packet_dup(packet_t *src)
+int packet_v1_compatible(packet_t *pack)
 {
-	packet_t *copy = malloc(PACKET_SIZE);
-	if (!copy)
+	struct packet_buf *buf = to_buf(pack);
+	return buf->len <= PACKET_CONTENT_SIZE && buf->id <= 0xFFFF && buf->dest <= 1;
+}
+
+void packet_parse_v1(packet_t *pack)
+{
+	struct packet_buf *buf = to_buf(pack);
+
+	buf->id = ntohs(pack->packet.id);
+	buf->len = PACKET_CONTENT_SIZE;
+	buf->dest = pack->packet.dest & 0x01;
+}
+
+static inline void put_be32(char *p, uint32_t val)
+{
+	val = htonl(val);
+	memcpy(p, &val, 4);
+}
+
+static inline uint32_t get_be32(const char *p)
+{
+	uint32_t val;
+	memcpy(&val, p, 4);
+	return ntohl(val);
+}
+
+unsigned int packet_v2_header(packet_t *pack, char *hdr)
+{
+	struct packet_buf *buf = to_buf(pack);
+
+	hdr[0] = PACKET_V2_HDR_SIZE;
+	hdr[1] = pack->packet.type;
+	hdr[2] = 0;
+	hdr[3] = 0;
+	put_be32(hdr + 4, buf->dest);
+	put_be32(hdr + 8, buf->len);
+	put_be32(hdr + 12, buf->id >> 32);
+	put_be32(hdr + 16, (uint32_t) buf->id);
+
+	return PACKET_V2_HDR_SIZE;
+}
+
+int packet_v2_parse_header(const char *hdr, struct packet_v2_hdr *fields)
+{
+	if ((unsigned char) hdr[0] < PACKET_V2_HDR_SIZE)
+		return -EPROTO;
+
+	fields->type = hdr[1];
+	fields->dest = get_be32(hdr + 4);
+	fields->len = get_be32(hdr + 8);
+	fields->id = ((packet_id_t) get_be32(hdr + 12) << 32) | get_be32(hdr + 16);
+
+	if (fields->len > packet_max_payload)
+		return -EMSGSIZE;
+
+	return 0;
+}
+
+packet_t *packet_v2_alloc(struct packet_v2_hdr *fields)
+{
+	packet_t *pack = packet_alloc_payload(fields->len);
+	if (!pack)
 		return NULL;
-	return memcpy(copy, src, PACKET_SIZE);
+
+	packet_set_id(pack, fields->id);
+	packet_set_dest(pack, fields->dest);
+	pack->packet.type = fields->type;
+
+	return pack;
 }
 
-unsigned short packet_get_id(packet_t *pack)
+int packet_set_max_payload(unsigned int len)
 {
-	return ntohs(pack->packet.id);
+	if (len > PACKET_MAX_PAYLOAD_LIMIT)
+		return -EINVAL;
+	packet_max_payload = len;
+	return 0;
+}
+
+packet_t *packet_cre_version(unsigned char flags)
+{
+	packet_t *pack = packet_alloc();
+	if (!pack)
+		return NULL;
+
+	pack->packet.type = 'V';
+	pack->packet.content[0] = 2;
+	pack->packet.content[1] = flags;
+	put_be32(&pack->packet.content[2], packet_max_payload);
+
+	return pack;
+}
+
+void packet_parse_version(packet_t *pack, unsigned char *version, unsigned char *flags,
+	unsigned int *max_payload)
+{
+	*version = pack->packet.content[0];
+	*flags = pack->packet.content[1];
+	*max_payload = get_be32(&pack->packet.content[2]);
 }
 
 packet_t *packet_cre_neighbor(struct sockaddr_in *neigh)
@@ -50,7 +255,7 @@ void packet_parse_neighbor(packet_t *pack, struct sockaddr_in *neigh)
 	memcpy(&neigh->sin_port, &pack->packet.content[4], 2);
 }
 
-packet_t *packet_cre_content(unsigned short id, char dest, void *buf, size_t len)
+packet_t *packet_cre_content(unsigned short id, packet_dest_t dest, void *buf, size_t len)
 {
 	packet_t *pack = packet_alloc();
 	if (!pack)
@@ -59,10 +264,24 @@ packet_t *packet_cre_content(unsigned short id, char dest, void *buf, size_t len
 	if (len > 128)
 		len = 128;
 
-	pack->packet.id = htons(id);
-	pack->packet.dest = dest;
+	packet_set_id(pack, id);
+	packet_set_dest(pack, dest);
 	pack->packet.type = 'C';
 	memcpy(&pack->packet.content, buf, len);
 
 	return pack;
 }
+
+packet_t *packet_cre_message(packet_id_t id, packet_dest_t dest, void *buf, size_t len)
+{
+	packet_t *pack = packet_alloc_payload(len);
+	if (!pack)
+		return NULL;
+
+	packet_set_id(pack, id);
+	packet_set_dest(pack, dest);
+	pack->packet.type = 'C';
+	memcpy(packet_get_payload(pack), buf, len);
+
+	return pack;
+}
@@ -1,17 +1,49 @@
 #ifndef PACKET_H
 #define PACKET_H
 
+#include <stddef.h>
+#include <stdint.h>
 
 /*
- * Packet structure:
+ * Packet structure, version 1:
  * || 2 Bytes  || 1 Byte                   || 1 Byte                        || 128 Bytes ||
  * || Paket-ID || Ziel (1) oder Quelle (0) || Paket Typ ('C', 'O' oder 'N') || Inhalt    ||
  * || 0, 1     || 2                        || 3                             || 4-131     ||
+ *
+ * Version 2 frame, all in network byte order: a header starting with its own
+ * length, followed by the payload. Receivers skip header bytes they don't
+ * know, so fields can be appended.
+ * || 1 Byte     || 1 Byte || 2 Bytes || 4 Bytes || 4 Bytes        || 8 Bytes   || n Bytes ||
+ * || Header len || Typ    || Flags   || Ziel    || Payload len n  || Paket-ID  || Payload ||
+ * || 0          || 1      || 2, 3    || 4-7     || 8-11           || 12-19     || 20-     ||
+ *
+ * Connections start with version 1. Version 2 is negotiated with 'V' packets
+ * (version 1 frames, ignored by old nodes): the connecting side offers it, a
+ * node knowing that the peer understands version 2 sends a 'V' packet with
+ * the switch flag. All frames it sends afterwards are version 2.
+ * 'V' content: || 1 Byte: max. version || 1 Byte: flags || 4 Bytes: max. payload ||
  */
 
 #define PACKET_SIZE				132
 #define PACKET_CONTENT_SIZE		128
 
+/** size of the version 2 header written, the maximum read is 255 */
+#define PACKET_V2_HDR_SIZE		20
+#define PACKET_V2_HDR_MAX		255
+
+/** 'V' packet flag: the sender switches to version 2 after this packet */
+#define PACKET_VERSION_SWITCH	0x01
+
+/** default and upper limit of the maximum payload size */
+#define PACKET_DEFAULT_MAX_PAYLOAD	(64 * 1024)
+#define PACKET_MAX_PAYLOAD_LIMIT	(16 * 1024 * 1024)
+
+/** packet ID, 16 bits used in version 1 */
+typedef uint64_t packet_id_t;
+
+/** destination node ID, 0 ('Q') or 1 ('Z') in version 1 */
+typedef uint32_t packet_dest_t;
+
 // struct representation of the packet. only works since this will have no padding
 struct __packet {
 	unsigned short id;
@@ -30,18 +62,59 @@ typedef union packet {
 // forward declarations
 struct sockaddr_in;
 
+/** version 2 header fields */
+struct packet_v2_hdr {
+	char type;
+	packet_dest_t dest;
+	unsigned int len;
+	packet_id_t id;
+};
+
+/** maximum payload size accepted, set with packet_set_max_payload() */
+extern unsigned int packet_max_payload;
+
+/*
+ * Packets are reference counted buffers from the packet pool. They are
+ * shared instead of copied, e.g. between the receiver, the send queue and
+ * the outbound queues of all connections a packet is broadcast to. A shared
+ * packet must not be modified.
+ */
+
 /**
- * allocates a new packet, all 0. Must be free()d by caller
+ * allocates a new packet from the packet pool, all 0, with one reference.
+ * Must be packet_put() by caller
  * @return the new packet
  */
 packet_t *packet_alloc();
 
 /**
- * duplicates an existing packet. Must be free()d by caller
- * @param src the original packet
- * @return the duplicated packet
+ * allocates a new packet with a payload of the given size, all 0, with one
+ * reference. Payloads up to PACKET_CONTENT_SIZE are stored in the packet
+ * itself. Must be packet_put() by caller
+ * @param len the payload length
+ * @return the new packet, NULL if out of memory
+ */
+packet_t *packet_alloc_payload(unsigned int len);
+
+/**
+ * takes a reference on a packet allocated by any of the packet functions
+ * @param pack the packet
+ * @return the packet
+ */
+packet_t *packet_get(packet_t *pack);
+
+/**
+ * checks if anyone else holds a reference on a packet
+ * @param pack the packet
+ * @return true value if there is more than one reference
+ */
+int packet_is_shared(packet_t *pack);
+
+/**
+ * releases a reference on a packet, the last one frees it
+ * @param pack the packet, NULL is ignored
  */
-packet_t *packet_dup(packet_t *src);
+void packet_put(packet_t *pack);
 
 /**
  * returns the type of the packet
@@ -64,34 +137,109 @@ static inline void packet_set_type(packet_t *pack, char type)
 }
 
 /**
- * returns the destination (0 or 1)
+ * returns the destination
  * @param pack the packet
- * @return dest as char
+ * @return the destination node ID
  */
-static inline char packet_get_dest(packet_t *pack)
-{
-	return pack->packet.dest & 0x01;
-}
+packet_dest_t packet_get_dest(packet_t *pack);
+
+/**
+ * sets the destination
+ * @param pack the packet
+ * @param dest the destination node ID, only 0 and 1 can be sent to version 1 peers
+ */
+void packet_set_dest(packet_t *pack, packet_dest_t dest);
 
 /**
  * returns the packet ID
  * @param pack the packet
  * @return packet ID
  */
-unsigned short packet_get_id(packet_t *pack);
+packet_id_t packet_get_id(packet_t *pack);
 
+/**
+ * sets the packet ID
+ * @param pack the packet
+ * @param id the packet ID, only the lower 16 bits are sent to version 1 peers
+ */
+void packet_set_id(packet_t *pack, packet_id_t id);
 
 /**
- * returns the pointer to the packet's conent
+ * returns the pointer to the packet's payload, packet_get_len() bytes
  */
-static inline char *packet_get_content(packet_t *pack)
-{
-	return pack->packet.content;
-}
+char *packet_get_payload(packet_t *pack);
+
+/**
+ * returns the payload length, PACKET_CONTENT_SIZE for version 1 packets
+ */
+unsigned int packet_get_len(packet_t *pack);
+
+/**
+ * checks if a packet can be sent as version 1 frame: small payload, ID and
+ * destination
+ * @param pack the packet
+ * @return true value if it can
+ */
+int packet_v1_compatible(packet_t *pack);
+
+/**
+ * sets up a packet received as version 1 frame
+ * @param pack the packet
+ */
+void packet_parse_v1(packet_t *pack);
+
+/**
+ * writes the version 2 header of a packet
+ * @param pack the packet
+ * @param hdr buffer receiving PACKET_V2_HDR_SIZE bytes
+ * @return the header length
+ */
+unsigned int packet_v2_header(packet_t *pack, char *hdr);
+
+/**
+ * parses a complete version 2 header, the length is in the first byte
+ * @param hdr the header
+ * @param fields receives the header fields
+ * @return 0 on success, -EPROTO if too short, -EMSGSIZE if the payload is
+ * larger than packet_max_payload
+ */
+int packet_v2_parse_header(const char *hdr, struct packet_v2_hdr *fields);
+
+/**
+ * allocates a packet for a parsed version 2 header, the payload is to be
+ * received into packet_get_payload()
+ * @param fields the header fields
+ * @return the packet, NULL if out of memory
+ */
+packet_t *packet_v2_alloc(struct packet_v2_hdr *fields);
+
+/**
+ * sets the maximum payload size accepted and announced to peers
+ * @param len the size in bytes, up to PACKET_MAX_PAYLOAD_LIMIT
+ * @return 0 on success, -EINVAL if too large
+ */
+int packet_set_max_payload(unsigned int len);
+
+/**
+ * creates a 'V' packet announcing version 2 support
+ * @param flags 0 or PACKET_VERSION_SWITCH
+ * @return new packet, must be packet_put() by caller
+ */
+packet_t *packet_cre_version(unsigned char flags);
+
+/**
+ * parses a 'V' packet
+ * @param pack the packet
+ * @param version receives the max. version supported by the peer
+ * @param flags receives the flags
+ * @param max_payload receives the max. payload accepted by the peer
+ */
+void packet_parse_version(packet_t *pack, unsigned char *version, unsigned char *flags,
+	unsigned int *max_payload);
 
 /**
  * creates a new packet with an 'N' (add neighbor) request for the specified
- * IPv4 address. The packet returned must be free()d by caller
+ * IPv4 address. The packet returned must be packet_put() by caller
  * @param neighbor address
  * @return new packet
  */
@@ -110,8 +258,19 @@ void packet_parse_neighbor(packet_t *pack, struct sockaddr_in *neigh);
  * @param dest the destination
  * @param buf pointer to the buffer with the content
  * @param len the length of buffer, anything > 128 gets truncated to 128 bytes
- * @return new packet
+ * @return new packet, must be packet_put() by caller
+ */
+packet_t *packet_cre_content(unsigned short id, packet_dest_t dest, void *buf, size_t len);
+
+/**
+ * creates a content packet (type 'C') with a payload of any length, to be
+ * sent as version 2 frame if larger than PACKET_CONTENT_SIZE
+ * @param id the packet ID
+ * @param dest the destination
+ * @param buf pointer to the buffer with the content
+ * @param len the length of buffer
+ * @return new packet, must be packet_put() by caller
  */
-packet_t *packet_cre_content(unsigned short id, char dest, void *buf, size_t len);
+packet_t *packet_cre_message(packet_id_t id, packet_dest_t dest, void *buf, size_t len);
 
 #endif
@@ -0,0 +1,238 @@
+/**
+ * Packet pool
+ *
+ * Packet buffers are carved from cache line aligned slabs. Each thread keeps
+ * a small cache of free buffers as a singly linked list, so allocating and
+ * freeing normally doesn't touch any shared state. Only when a thread's cache
+ * runs empty or overflows, a batch of buffers is moved from or to the shared
+ * depot under the pool lock. The depot is a stack of batches, each batch a
+ * list of PKTPOOL_BATCH buffers. Memory is never returned to the system.
+ *
+ * Written by agent
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "lib/utils.h"
+#include "lib/list.h"
+
+#include "pktpool.h"
+
+/** a free object */
+struct pool_obj {
+	struct pool_obj *next;
+
+	// only used on the first object of a batch in the depot
+	struct pool_obj *batch_next;
+	unsigned int batch_count;
+};
+
+/** per-thread cache */
+struct pool_cache {
+	struct pool_obj *head;
+	unsigned int count;
+
+	// only touched by the owning thread, read for statistics
+	unsigned long allocs;
+	unsigned long frees;
+
+	list_head_t list_entry;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool_obj *depot;
+static unsigned long depot_objs;
+static unsigned long num_slabs;
+
+// statistics: all thread caches, the counters of exited threads and
+// of frees without a cache
+static LIST_HEAD(cache_list);
+static unsigned long retired_allocs;
+static unsigned long retired_frees;
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static __thread struct pool_cache *cache;
+
+/* pushes a batch of num objects linked from first onto the depot, pool_lock held */
+static void depot_push(struct pool_obj *first, unsigned int num)
+{
+	first->batch_next = depot;
+	first->batch_count = num;
+	depot = first;
+	depot_objs += num;
+}
+
+/* gives a batch from the cache to the depot, pool_lock held */
+static void depot_put(struct pool_cache *c, unsigned int num)
+{
+	struct pool_obj *first = c->head, *last = c->head;
+
+	for (unsigned int i = 1; i < num; i++)
+		last = last->next;
+	c->head = last->next;
+	c->count -= num;
+	last->next = NULL;
+
+	depot_push(first, num);
+}
+
+/* returns everything cached by an exiting thread to the depot */
+static void cache_destroy(void *arg)
+{
+	struct pool_cache *c = arg;
+
+	pthread_mutex_lock(&pool_lock);
+	while (c->count >= PKTPOOL_BATCH)
+		depot_put(c, PKTPOOL_BATCH);
+	if (c->count)
+		depot_put(c, c->count);
+	list_remove(&c->list_entry);
+	retired_allocs += c->allocs;
+	retired_frees += c->frees;
+	pthread_mutex_unlock(&pool_lock);
+
+	free(c);
+	cache = NULL;
+}
+
+static void cache_key_create()
+{
+	pthread_key_create(&cache_key, cache_destroy);
+}
+
+static struct pool_cache *cache_get()
+{
+	if (cache)
+		return cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	pthread_once(&cache_key_once, cache_key_create);
+	pthread_setspecific(cache_key, cache);
+
+	pthread_mutex_lock(&pool_lock);
+	list_add(&cache->list_entry, &cache_list);
+	pthread_mutex_unlock(&pool_lock);
+
+	return cache;
+}
+
+/* allocates a new slab and puts it into the depot, pool_lock held */
+static int slab_grow()
+{
+	char *slab;
+	struct pool_obj *obj;
+
+	if (posix_memalign((void **) &slab, CACHELINE_SIZE, PKTPOOL_SLAB_OBJS * PKTPOOL_OBJ_SIZE))
+		return -1;
+
+	for (unsigned int i = 0; i < PKTPOOL_SLAB_OBJS; i += PKTPOOL_BATCH) {
+		for (unsigned int j = 0; j < PKTPOOL_BATCH; j++) {
+			obj = (struct pool_obj *) (slab + (i + j) * PKTPOOL_OBJ_SIZE);
+			obj->next = j + 1 < PKTPOOL_BATCH ?
+				(struct pool_obj *) (slab + (i + j + 1) * PKTPOOL_OBJ_SIZE) : NULL;
+		}
+		depot_push((struct pool_obj *) (slab + i * PKTPOOL_OBJ_SIZE), PKTPOOL_BATCH);
+	}
+
+	num_slabs++;
+
+	dbg("Packet pool grown to %lu packets\n", num_slabs * PKTPOOL_SLAB_OBJS);
+	return 0;
+}
+
+/* gets a batch from the depot into an empty cache */
+static int cache_refill(struct pool_cache *c)
+{
+	struct pool_obj *batch;
+
+	pthread_mutex_lock(&pool_lock);
+	if (!depot && slab_grow()) {
+		pthread_mutex_unlock(&pool_lock);
+		return -1;
+	}
+	batch = depot;
+	depot = batch->batch_next;
+	depot_objs -= batch->batch_count;
+	pthread_mutex_unlock(&pool_lock);
+
+	c->head = batch;
+	c->count = batch->batch_count;
+	return 0;
+}
+
+void *pktpool_alloc()
+{
+	struct pool_cache *c = cache_get();
+	struct pool_obj *obj;
+
+	if (!c)
+		return NULL;
+
+	if (!c->head && cache_refill(c))
+		return NULL;
+
+	obj = c->head;
+	c->head = obj->next;
+	c->count--;
+	atomic_store_relaxed(&c->allocs, c->allocs + 1);
+
+	return obj;
+}
+
+void pktpool_free(void *ptr)
+{
+	struct pool_cache *c;
+	struct pool_obj *obj = ptr;
+
+	if (!obj)
+		return;
+
+	// no cache for this thread: straight to the depot as a batch of one
+	c = cache_get();
+	if (!c) {
+		obj->next = NULL;
+		pthread_mutex_lock(&pool_lock);
+		depot_push(obj, 1);
+		retired_frees++;
+		pthread_mutex_unlock(&pool_lock);
+		return;
+	}
+
+	obj->next = c->head;
+	c->head = obj;
+	c->count++;
+	atomic_store_relaxed(&c->frees, c->frees + 1);
+
+	if (c->count > PKTPOOL_CACHE_MAX) {
+		pthread_mutex_lock(&pool_lock);
+		depot_put(c, PKTPOOL_BATCH);
+		pthread_mutex_unlock(&pool_lock);
+	}
+}
+
+void pktpool_get_stats(struct pktpool_stats *stats)
+{
+	struct pool_cache *c;
+	unsigned long allocs, frees;
+
+	pthread_mutex_lock(&pool_lock);
+	allocs = retired_allocs;
+	frees = retired_frees;
+	list_for_each_entry(c, &cache_list, list_entry) {
+		allocs += atomic_load_relaxed(&c->allocs);
+		frees += atomic_load_relaxed(&c->frees);
+	}
+
+	stats->slabs = num_slabs;
+	stats->objects = num_slabs * PKTPOOL_SLAB_OBJS;
+	stats->depot = depot_objs;
+	stats->in_use = allocs - frees;
+	stats->allocs = allocs;
+	stats->frees = frees;
+	pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,64 @@
+#ifndef PKTPOOL_H
+#define PKTPOOL_H
+
+/**
+ * Packet pool: fixed-size allocator for packet buffers
+ *
+ * Written by agent
+ */
+
+#include "lib/atomic.h"
+
+#include "packet.h"
+
+/** size of one pool object: a packet rounded up to full cache lines */
+#define PKTPOOL_OBJ_SIZE	((PACKET_SIZE + CACHELINE_SIZE - 1) & ~(CACHELINE_SIZE - 1))
+
+/** number of objects allocated at once when the pool runs empty */
+#define PKTPOOL_SLAB_OBJS	256
+
+/** objects moved between a thread's cache and the shared depot at once */
+#define PKTPOOL_BATCH		32
+
+/** max. number of objects cached per thread before returning a batch */
+#define PKTPOOL_CACHE_MAX	(2 * PKTPOOL_BATCH)
+
+/** pool statistics */
+struct pktpool_stats {
+	// slabs allocated so far, the pool never shrinks
+	unsigned long slabs;
+
+	// high-water mark: number of objects ever allocated from the system
+	unsigned long objects;
+
+	// objects in the shared depot
+	unsigned long depot;
+
+	// objects currently handed out
+	unsigned long in_use;
+
+	// objects handed out and returned so far
+	unsigned long allocs;
+	unsigned long frees;
+};
+
+/**
+ * allocates a packet buffer from the pool. Contents are undefined.
+ * @return the buffer, PKTPOOL_OBJ_SIZE bytes, cache line aligned. NULL if
+ * out of memory
+ */
+void *pktpool_alloc();
+
+/**
+ * returns a buffer to the pool. Can be called from any thread.
+ * @param obj the buffer, NULL is ignored
+ */
+void pktpool_free(void *obj);
+
+/**
+ * gets the pool statistics. Takes the global pool lock, not for the fast path
+ * @param stats pointer to the struct receiving the statistics
+ */
+void pktpool_get_stats(struct pktpool_stats *stats);
+
+#endif
@@ -1,5 +1,6 @@
 /*
- * Handling of receiving side, one thread per connection
+ * Handling of receiving side, one receiver and one writer thread per
+ * connection or driven by the event loop
  *
  * Written by Daniel Ritz
  */
@@ -9,6 +10,7 @@
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -19,37 +21,53 @@
 #include "receiver.h"
 #include "packet.h"
 #include "idcache.h"
+#include "dupfilter.h"
 #include "sendq.h"
 #include "routing.h"
+#include "evloop.h"
+#include "uring.h"
+#include "metrics.h"
 
 enum mesh_node_role node_role = normal_node;
+packet_dest_t node_dest;
+
+void receiver_set_role(enum mesh_node_role role, packet_dest_t dest)
+{
+	node_role = role;
+	node_dest = dest;
+}
 
 static void process_C_packet(connection_t *conn, packet_t *packet)
 {
 	int seen, err;
-	char dest = packet_get_dest(packet);
-	unsigned short id = packet_get_id(packet);
+	packet_dest_t dest = packet_get_dest(packet);
+	packet_id_t id = packet_get_id(packet);
 
-	dbg("Received 'C' packet with id %hd for %hhd\n", id, dest);
+	dbg("Received 'C' packet with id %llu for %u\n", (unsigned long long) id, dest);
 
-	// check/add ID to cache
-	seen = idcache_put(conn, dest, id);
+	// drop duplicates, remember the origin for the ack
+	seen = dupfilter_check(dest, id);
 	if (seen) {
-		dbg("  Packet with ID %hd received before, dropping\n", id);
+		metrics_inc(METRIC_DUPLICATES);
+		dbg("  Packet with ID %llu received before, dropping\n", (unsigned long long) id);
 		return;
 	}
+	idcache_put(conn, dest, id);
 
 	// check if destination reached
-	if ((dest == 0 && node_role == src_node) ||
-	    (dest == 1 && node_role == dest_node))
-	{
-		dbg("  Packet with ID %hd reached destination\n", id);
-		fwrite(packet_get_content(packet), PACKET_CONTENT_SIZE, 1, stdout);
+	if (node_role != normal_node && dest == node_dest) {
+		metrics_inc(METRIC_DELIVERED);
+		dbg("  Packet with ID %llu reached destination\n", (unsigned long long) id);
+		fwrite(packet_get_payload(packet), packet_get_len(packet), 1, stdout);
 		fflush(stdout);
 
 		// change the type from 'C' to 'O', send back
 		packet_set_type(packet, 'O');
-		connection_send_packet(conn, packet);
+		err = connection_send_packet(conn, packet);
+		if (err) {
+			metrics_inc(METRIC_SEND_FAILURES);
+			dbg("  Failed queueing Ack packet with ID %llu (%d)\n", (unsigned long long) id, err);
+		}
 
 		return;
 	}
@@ -65,33 +83,38 @@ static void process_C_packet(connection_t *conn, packet_t *packet)
 static void process_O_packet(connection_t *conn, packet_t *packet)
 {
 	connection_t *origin;
-	char dest = packet_get_dest(packet);
-	unsigned short id = packet_get_id(packet);
-	ssize_t len;
-	mstime_t time_sent;
+	packet_dest_t dest = packet_get_dest(packet);
+	packet_id_t id = packet_get_id(packet);
+	int err;
+	ustime_t time_received;
 
-	dbg("Received 'O' packet with id %hd for %hhd\n", id, dest);
+	dbg("Received 'O' packet with id %llu for %u\n", (unsigned long long) id, dest);
 
-	origin = idcache_get_origin(dest, id, &time_sent);
+	origin = idcache_get_origin(dest, id, &time_received);
 	if (!origin) {
-		dbg("  Ack packet received for unknown ID or received before: %hd; dropped.\n", id);
+		metrics_inc(METRIC_ACKS_UNKNOWN);
+		dbg("  Ack packet received for unknown ID or received before: %llu; dropped.\n",
+			(unsigned long long) id);
 		return;
 	}
 
 	// 'conn' is a good connection, update route to use it
-	route_mark_alive(conn, dest, time_sent);
+	route_mark_alive(conn, dest, time_received);
 
 	// send ACK directly to the origination connection
-	len = connection_send_packet(origin, packet);
+	err = connection_send_packet(origin, packet);
 
 	// release ownership of the cached connection
 	connection_release(origin);
 
-	if (len == PACKET_SIZE) {
-		dbg("  Successfully sent Ack packet with id %hd back to origination connection\n", id);
+	if (!err) {
+		metrics_inc(METRIC_ACKS_FORWARDED);
+		dbg("  Queued Ack packet with id %llu back to origination connection\n",
+			(unsigned long long) id);
 	} else {
-		dbg("  Failed sending Ack packet with ID %hd back to receiver (%zd/%d bytes sent)\n",
-			id, len, PACKET_SIZE);
+		metrics_inc(METRIC_SEND_FAILURES);
+		dbg("  Failed queueing Ack packet with ID %llu back to receiver (%d)\n",
+			(unsigned long long) id, err);
 	}
 }
 
@@ -127,65 +150,468 @@ out_err:
 	return;
 }
 
-static void *receiver_thread(void *arg)
+static void process_V_packet(connection_t *conn, packet_t *packet)
 {
-	connection_t *conn;
-	packet_t *packet;
-	ssize_t len;
+	unsigned char version, flags;
+	unsigned int max_payload;
+	packet_t *reply;
+	int err;
+
+	packet_parse_version(packet, &version, &flags, &max_payload);
+
+	dbg("Received 'V' packet: version %hhu, flags %hhx, max. payload %u\n",
+		version, flags, max_payload);
+
+	if (version < 2)
+		return;
+
+	// set before the switch is queued, the writer reads it for the frames after
+	atomic_store_relaxed(&conn->peer_max_payload, max_payload);
+
+	// all frames after this one are version 2
+	if (flags & PACKET_VERSION_SWITCH)
+		conn->rx_version = 2;
+
+	// the peer understands version 2: switch as well, once
+	if (conn->tx_switch_queued)
+		return;
+	conn->tx_switch_queued = 1;
+
+	reply = packet_cre_version(PACKET_VERSION_SWITCH);
+	if (!reply)
+		return;
+	err = connection_send_packet(conn, reply);
+	if (err)
+		dbg("  Failed queueing 'V' packet (%d)\n", err);
+	packet_put(reply);
+}
+
+void receiver_process(connection_t *conn, packet_t *packet)
+{
+	char type = packet_get_type(packet);
+
+	metrics_inc(METRIC_PACKETS_RECEIVED);
+	atomic_store_relaxed(&conn->rx_packets, conn->rx_packets + 1);
+
+	switch (type) {
+	case 'C':
+		process_C_packet(conn, packet);
+		break;
+
+	case 'O':
+		process_O_packet(conn, packet);
+		break;
+
+	case 'N':
+		process_N_packet(conn, packet);
+		break;
+
+	case 'V':
+		process_V_packet(conn, packet);
+		break;
+
+	default:
+		dbg("Unknown packet type received: %c\n", type);
+		break;
+	}
+}
+
+/*
+ * Batched receive: one readv() fills the partial packet of the connection
+ * followed by the packet buffers of the thread's receive batch. Buffers
+ * nobody took a reference on are reused for the next read, the others are
+ * replaced by new ones before the next read. Version 2 frames have any size,
+ * large payloads are read straight into their packet, small frames through a
+ * staging buffer.
+ */
+struct rx_batch {
+	packet_t *pkts[RECEIVER_BATCH];
+	char stage[RECEIVER_STAGE_SIZE];
+};
+
+static pthread_key_t rx_batch_key;
+static pthread_once_t rx_batch_once = PTHREAD_ONCE_INIT;
+static __thread struct rx_batch *rx_batch;
+
+static void rx_batch_destroy(void *arg)
+{
+	struct rx_batch *batch = arg;
+
+	for (unsigned int i = 0; i < RECEIVER_BATCH; i++)
+		packet_put(batch->pkts[i]);
+	free(batch);
+	rx_batch = NULL;
+}
+
+static void rx_batch_key_create()
+{
+	pthread_key_create(&rx_batch_key, rx_batch_destroy);
+}
+
+static struct rx_batch *rx_batch_get()
+{
+	if (rx_batch)
+		return rx_batch;
+
+	rx_batch = calloc(1, sizeof(*rx_batch));
+	if (!rx_batch)
+		return NULL;
+
+	pthread_once(&rx_batch_once, rx_batch_key_create);
+	pthread_setspecific(rx_batch_key, rx_batch);
+	return rx_batch;
+}
+
+/* keeps an unshared buffer for the next read, drops a shared one */
+static inline void rx_recycle(packet_t **pkt)
+{
+	if (packet_is_shared(*pkt)) {
+		packet_put(*pkt);
+		*pkt = NULL;
+	}
+}
+
+/* version 2: true value if the header is complete and the payload is being received */
+static inline int rx_in_payload(connection_t *conn)
+{
+	return conn->rxhdrlen && conn->rxhdrlen == (unsigned char) conn->rxhdr[0];
+}
+
+/* processes the packet completely received, resets the receive state */
+static void rx_complete(connection_t *conn)
+{
+	receiver_process(conn, conn->rxpkt);
+	packet_put(conn->rxpkt);
+	conn->rxpkt = NULL;
+	conn->rxlen = 0;
+	conn->rxhdrlen = 0;
+}
+
+/* version 2: the header is complete, sets up the packet receiving the payload */
+static int rx_header_done(connection_t *conn)
+{
+	struct packet_v2_hdr fields;
 	char hoststr[INET_ADDRSTRLEN];
+	int err;
 
-	conn = arg;
+	err = packet_v2_parse_header(conn->rxhdr, &fields);
+	if (err) {
+		dbg("Invalid version 2 header from %s:%hu (%d)\n",
+			net_addr_str(connection_get_addr(conn), hoststr, sizeof(hoststr)),
+			connection_get_port(conn), err);
+		return err;
+	}
 
-	packet = packet_alloc();
-	if (!packet)
-		goto out;
+	// a buffer left from version 1 frames
+	packet_put(conn->rxpkt);
+	conn->rxpkt = packet_v2_alloc(&fields);
+	conn->rxlen = 0;
+	if (!conn->rxpkt)
+		return -ENOMEM;
 
-	net_addr_str(connection_get_addr(conn), hoststr, sizeof(hoststr));
+	if (!fields.len)
+		rx_complete(conn);
+	return 0;
+}
 
-	if (connection_unconnected(conn)) {
-		dbg("Receiver: trying to connect to %s:%hu\n", hoststr, connection_get_port(conn));
-		int newfd = net_connect(connection_get_addr(conn));
-		if (check_error(newfd)) {
-			dbg("  Cannot connect to %s:%hu\n", hoststr, connection_get_port(conn));
-			goto out;
+int receiver_input(connection_t *conn, const char *data, size_t len)
+{
+	size_t num, need;
+	int err;
+
+	while (len) {
+		if (conn->rx_version < 2) {
+			// version 1: fixed size frames
+			if (!conn->rxpkt) {
+				conn->rxpkt = packet_alloc();
+				if (!conn->rxpkt)
+					return -ENOMEM;
+			}
+			num = PACKET_SIZE - conn->rxlen;
+			if (num > len)
+				num = len;
+			memcpy(conn->rxpkt->raw + conn->rxlen, data, num);
+			conn->rxlen += num;
+
+			if (conn->rxlen == PACKET_SIZE) {
+				packet_parse_v1(conn->rxpkt);
+				rx_complete(conn);
+			}
+		} else if (!rx_in_payload(conn)) {
+			// version 2 header, the first byte is its length
+			need = conn->rxhdrlen ? (unsigned char) conn->rxhdr[0] : 1;
+			num = need - conn->rxhdrlen;
+			if (num > len)
+				num = len;
+			memcpy(conn->rxhdr + conn->rxhdrlen, data, num);
+			conn->rxhdrlen += num;
+
+			if (conn->rxhdrlen == 1 && (unsigned char) conn->rxhdr[0] < PACKET_V2_HDR_SIZE)
+				return -EPROTO;
+			if (rx_in_payload(conn)) {
+				err = rx_header_done(conn);
+				if (err)
+					return err;
+			}
+		} else {
+			// version 2 payload
+			num = packet_get_len(conn->rxpkt) - conn->rxlen;
+			if (num > len)
+				num = len;
+			memcpy(packet_get_payload(conn->rxpkt) + conn->rxlen, data, num);
+			conn->rxlen += num;
+
+			if (conn->rxlen == packet_get_len(conn->rxpkt))
+				rx_complete(conn);
 		}
-		connection_connect(conn, newfd);
-		dbg("  Connected to %s:%hu\n", hoststr, connection_get_port(conn));
+
+		data += num;
+		len -= num;
 	}
 
-	for (;;) {
-		len = recv(connection_get_fd(conn), packet, PACKET_SIZE, MSG_WAITALL);
+	return 0;
+}
 
-		if (len == -1 && errno == EINTR)
-			continue;
-		if (len != PACKET_SIZE)
-			break;
+/*
+ * version 2: reads the rest of a payload straight into its packet. Behind a
+ * payload of RECEIVER_COPY_MAX bytes and more, only the minimal header size
+ * is read into the connection, the next payload again goes into its packet.
+ * Otherwise the frames behind are read into the staging buffer and copied:
+ * for small frames a copy is cheaper than a syscall each.
+ */
+static ssize_t receiver_read_v2(connection_t *conn, struct rx_batch *batch)
+{
+	struct iovec iov[2];
+	unsigned int num = 0;
+	int in_payload = rx_in_payload(conn);
+	int direct = in_payload && packet_get_len(conn->rxpkt) >= RECEIVER_COPY_MAX;
+	size_t left;
+	ssize_t len;
+	int err;
 
-		char type = packet_get_type(packet);
-		switch (type) {
-		case 'C':
-			process_C_packet(conn, packet);
+	if (in_payload) {
+		iov[num].iov_base = packet_get_payload(conn->rxpkt) + conn->rxlen;
+		iov[num].iov_len = packet_get_len(conn->rxpkt) - conn->rxlen;
+		num++;
+	}
+
+	// the next header overwrites the one of the payload
+	if (direct) {
+		iov[num].iov_base = conn->rxhdr;
+		iov[num].iov_len = PACKET_V2_HDR_SIZE;
+	} else {
+		iov[num].iov_base = batch->stage;
+		iov[num].iov_len = RECEIVER_STAGE_SIZE;
+	}
+	num++;
+
+	do {
+		len = readv(connection_get_fd(conn), iov, num);
+	} while (len == -1 && errno == EINTR);
+
+	if (len == -1)
+		return -errno;
+	if (len == 0)
+		return 0;
+
+	left = len;
+	if (in_payload) {
+		if (left < iov[0].iov_len) {
+			conn->rxlen += left;
+			return len;
+		}
+		left -= iov[0].iov_len;
+		rx_complete(conn);
+	}
+
+	if (!direct) {
+		err = receiver_input(conn, batch->stage, left);
+		return err ? err : len;
+	}
+
+	conn->rxhdrlen = left;
+	if (left && (unsigned char) conn->rxhdr[0] < PACKET_V2_HDR_SIZE)
+		return -EPROTO;
+	if (rx_in_payload(conn)) {
+		err = rx_header_done(conn);
+		if (err)
+			return err;
+	}
+
+	return len;
+}
+
+ssize_t receiver_read(connection_t *conn)
+{
+	struct rx_batch *batch;
+	struct iovec iov[RECEIVER_BATCH + 1];
+	unsigned int num, i;
+	size_t left;
+	ssize_t len;
+	packet_t *tmp;
+	int err;
+
+	batch = rx_batch_get();
+	if (!batch)
+		return -ENOMEM;
+
+	if (conn->rx_version >= 2)
+		return receiver_read_v2(conn, batch);
+
+	// receive straight into packet buffers, passed on without copying
+	if (!conn->rxpkt) {
+		conn->rxpkt = packet_alloc();
+		if (!conn->rxpkt)
+			return -ENOMEM;
+	}
+	iov[0].iov_base = conn->rxpkt->raw + conn->rxlen;
+	iov[0].iov_len = PACKET_SIZE - conn->rxlen;
+
+	for (num = 1; num < RECEIVER_BATCH + 1 && num < IOV_MAX; num++) {
+		if (!batch->pkts[num - 1])
+			batch->pkts[num - 1] = packet_alloc();
+		if (!batch->pkts[num - 1])
 			break;
+		iov[num].iov_base = batch->pkts[num - 1]->raw;
+		iov[num].iov_len = PACKET_SIZE;
+	}
+
+	do {
+		len = readv(connection_get_fd(conn), iov, num);
+	} while (len == -1 && errno == EINTR);
+
+	if (len == -1)
+		return -errno;
+	if (len == 0)
+		return 0;
+
+	// the partial packet of the connection is still incomplete
+	left = len;
+	if (left < iov[0].iov_len) {
+		conn->rxlen += left;
+		return len;
+	}
+	left -= iov[0].iov_len;
+
+	packet_parse_v1(conn->rxpkt);
+	receiver_process(conn, conn->rxpkt);
+	rx_recycle(&conn->rxpkt);
+	conn->rxlen = 0;
+
+	// all complete packets in the batch, until the peer switches to version 2
+	for (i = 0; left >= PACKET_SIZE && conn->rx_version < 2; i++, left -= PACKET_SIZE) {
+		packet_parse_v1(batch->pkts[i]);
+		receiver_process(conn, batch->pkts[i]);
+		rx_recycle(&batch->pkts[i]);
+	}
+
+	// the rest are version 2 frames
+	if (conn->rx_version >= 2) {
+		for (; left; i++) {
+			num = left < PACKET_SIZE ? left : PACKET_SIZE;
+			err = receiver_input(conn, batch->pkts[i]->raw, num);
+			if (err)
+				return err;
+			left -= num;
+		}
+		return len;
+	}
+
+	// partial trailing packet: keep it in the connection until the next read
+	if (left) {
+		tmp = conn->rxpkt;
+		conn->rxpkt = batch->pkts[i];
+		conn->rxlen = left;
+		batch->pkts[i] = tmp;
+	}
+
+	return len;
+}
+
+/* corking: wait for more packets until a full batch or the window is over */
+static void writer_cork(connection_t *conn)
+{
+	unsigned int ticket;
+	ustime_t now, deadline;
 
-		case 'O':
-			process_O_packet(conn, packet);
+	now = time_monotonic_us();
+	deadline = now + connection_cork_usec;
+
+	while (now < deadline && !connection_is_closed(conn)) {
+		ticket = waitq_prepare(&conn->outq_wait);
+		if (connection_output_count(conn) >= CONNECTION_TX_BATCH) {
+			waitq_cancel(&conn->outq_wait);
 			break;
+		}
+		waitq_wait_timeout(&conn->outq_wait, ticket, deadline - now);
+		now = time_monotonic_us();
+	}
+}
+
+static void *writer_thread(void *arg)
+{
+	connection_t *conn = arg;
+	unsigned int ticket;
+	int err;
+	char hoststr[INET_ADDRSTRLEN];
 
-		case 'N':
-			process_N_packet(conn, packet);
+	for (;;) {
+		ticket = waitq_prepare(&conn->outq_wait);
+		if (connection_is_closed(conn)) {
+			waitq_cancel(&conn->outq_wait);
 			break;
+		}
+		if (!connection_has_output(conn)) {
+			waitq_wait(&conn->outq_wait, ticket);
+			continue;
+		}
+		waitq_cancel(&conn->outq_wait);
+
+		if (connection_cork_usec)
+			writer_cork(conn);
 
-		default:
-			dbg("Unknown packet type received: %c\n", type);
+		// blocking socket: only returns once everything is written
+		err = connection_flush(conn);
+		if (err) {
+			dbg("Writer: failed writing to %s:%hu (%d)\n",
+				net_addr_str(connection_get_addr(conn), hoststr, sizeof(hoststr)),
+				connection_get_port(conn), err);
 			break;
 		}
 	}
+
+	connection_close(conn);
+	connection_release(conn);
+	return NULL;
+}
+
+static void *receiver_thread(void *arg)
+{
+	connection_t *conn;
+	char hoststr[INET_ADDRSTRLEN];
+
+	conn = arg;
+
+	net_addr_str(connection_get_addr(conn), hoststr, sizeof(hoststr));
+
+	if (connection_unconnected(conn)) {
+		dbg("Receiver: trying to connect to %s:%hu\n", hoststr, connection_get_port(conn));
+		int newfd = net_connect(connection_get_addr(conn));
+		if (check_error(newfd)) {
+			dbg("  Cannot connect to %s:%hu\n", hoststr, connection_get_port(conn));
+			goto out;
+		}
+		connection_connect(conn, newfd);
+		dbg("  Connected to %s:%hu\n", hoststr, connection_get_port(conn));
+	}
+
+	while (receiver_read(conn) > 0)
+		;
 	dbg("Destroying receiver for %s:%hu\n", hoststr, connection_get_port(conn));
 
 out:
 	connection_close(conn);
 	connection_release(conn);
-	free(packet);
 	return NULL;
 }
 
@@ -195,7 +621,22 @@ int receiver_create(connection_t *conn)
 	pthread_t thr;
 
 	if (!conn)
-		return EINVAL;
+		return -EINVAL;
+
+	// io_uring and event loop mode: no thread per connection
+	if (uring_enabled())
+		return uring_add(conn);
+	if (evloop_enabled())
+		return evloop_add(conn);
+
+	// the writer thread gets its own reference
+	connection_own(conn);
+	err = pthread_create(&thr, NULL, writer_thread, conn);
+	if (err) {
+		connection_release(conn);
+		return -err;
+	}
+	pthread_detach(thr);
 
 	err = pthread_create(&thr, NULL, receiver_thread, conn);
 	if (!err)
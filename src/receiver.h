@@ -1,6 +1,9 @@
 #ifndef RECEIVER_H
 #define RECEIVER_H
 
+#include <stddef.h>
+#include <sys/types.h>
+
 #include "connection.h"
 
 enum mesh_node_role {
@@ -11,11 +14,61 @@ enum mesh_node_role {
 
 extern enum mesh_node_role node_role;
 
+/** the destination node ID of this node, unless a normal node */
+extern packet_dest_t node_dest;
+
+/**
+ * sets the role of this node: the source (destination ID 0), the
+ * destination (1 or any other ID) or a normal node only forwarding packets
+ * @param role the role
+ * @param dest the destination node ID, ignored for normal nodes
+ */
+void receiver_set_role(enum mesh_node_role role, packet_dest_t dest);
+
 /**
- * Create a receiver thread for the given connection
+ * Create the receiver and writer threads for the given connection. In event
+ * loop mode, the connection is handed to the event loop instead.
  * @param conn the connection
- * @return return value of pthread_create
+ * @return 0 on success, error code (negative) otherwise
  */
 int receiver_create(connection_t *conn);
 
+/**
+ * Processes one complete packet received on a connection
+ * @param conn the connection the packet was received from
+ * @param packet the packet
+ */
+void receiver_process(connection_t *conn, packet_t *packet);
+
+/** max. number of packets received by one call to receiver_read() */
+#define RECEIVER_BATCH		((64 * 1024) / PACKET_SIZE)
+
+/** size of the buffer receiving small version 2 frames */
+#define RECEIVER_STAGE_SIZE	(64 * 1024)
+
+/** version 2 payloads from this size on are read without copying */
+#define RECEIVER_COPY_MAX	1024
+
+/**
+ * Processes data received on a connection, any amount: the packets completed
+ * are processed, a partially received packet is kept in the connection.
+ * Follows a switch to version 2 within the data.
+ * @param conn the connection the data was received from
+ * @param data the data
+ * @param len length of the data
+ * @return 0 on success, error code (negative) on protocol errors
+ */
+int receiver_input(connection_t *conn, const char *data, size_t len);
+
+/**
+ * Reads as much as available from the connection, up to RECEIVER_BATCH
+ * packets, or the rest of a version 2 payload and the next header or up to
+ * RECEIVER_STAGE_SIZE bytes of small frames behind it, with one
+ * syscall and processes all complete packets. A partially received packet is
+ * kept in the connection.
+ * @param conn the connection
+ * @return the number of bytes read, 0 on EOF, error code (negative) otherwise
+ */
+ssize_t receiver_read(connection_t *conn);
+
 #endif
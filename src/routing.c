@@ -1,116 +1,574 @@
 /**
  * Packet routing
  *
+ * The routes are kept in a hash table indexed by the destination, with open
+ * addressing and linear probing. An entry is created once an ack came back
+ * for a destination and lives as long as the table, so there are no
+ * deletions. Lookups don't take any lock: the table is replaced when it
+ * grows and the old one freed through epoch based reclamation. Writers are
+ * serialized by route_lock.
+ *
+ * The next hops of a destination are an immutable set, replaced as a whole
+ * when a hop or the fastest one changes, which is rare. Like the connection
+ * snapshot, it owns a reference on each connection until no reader can see
+ * it anymore, so readers find a route with a single acquire load and own
+ * the connection without any lock. The timestamps and RTT estimates change
+ * all the time, they're kept in the entry as relaxed atomics, only written
+ * when they change.
+ *
+ * Each destination has a few next hops with an estimate of the round trip
+ * time, measured from receiving a packet to receiving its ack. Packets go
+ * through the fastest hop, another one only takes over if it's faster by
+ * more than the variation of the RTT (hysteresis against flapping). The
+ * other hops are learned from broadcasts: now and then, a packet is
+ * broadcast despite a route, its ack returns through the fastest path.
+ *
+ * Hops that keep being acked and aren't much slower than the fastest one
+ * share the load: each packet goes through the better of two randomly
+ * chosen hops, judged by the number of packets queued and the RTT (power of
+ * two choices). The acks of these packets keep the hops validated.
+ *
+ * Every RTT sample also goes into a latency histogram of the destination
+ * and one of the neighbor it came through, both only written under
+ * route_lock. All times are monotonic.
+ *
  * Written by Daniel Ritz
  */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <errno.h>
 #include <sys/time.h>
 
 #include "lib/utils.h"
 #include "lib/net.h"
+#include "lib/atomic.h"
+#include "lib/epoch.h"
+#include "lib/hist.h"
 
 #include "routing.h"
-#include "idcache.h"
+#include "metrics.h"
+
+/** minimum number of slots of the route table, a power of two */
+#define ROUTE_TABLE_MIN		16
+
+/** max. number of next hops remembered per destination */
+#define ROUTE_MAX_HOPS		4
+
+/** interval of broadcasting a packet despite a route, finds faster paths. In milliseconds */
+#define ROUTE_PROBE_INTERVAL	1000
+
+/** time after the last ack a next hop is forgotten, in milliseconds */
+#define ROUTE_HOP_TTL		(3 * ROUTE_PROBE_INTERVAL)
+
+/** hysteresis: a hop must be faster by at least this fraction of the current RTT */
+#define ROUTE_HYSTERESIS_DIV	8
+
+/** multipath: other hops are used if their RTT is at most this factor of the current */
+#define ROUTE_MULTIPATH_STRETCH	2
 
 // configurable timeout in milliseconds
 int route_timeout = 200;
 
+/** RTT estimate of a next hop, by the index in the hop set */
+struct route_hop {
+	// smoothed RTT and its mean deviation in microseconds, like TCP (RFC 6298)
+	ustime_t srtt;
+	ustime_t rttvar;
+	unsigned int samples;
+
+	// time of the last ack received through the hop
+	mstime_t last_ack;
+};
+
+/** the next hops of a destination, immutable once published */
+struct route_set {
+	epoch_entry_t epoch_entry;
+
+	// the fastest hop, conns[] without a connection are NULL
+	unsigned int best;
+	connection_t *conns[ROUTE_MAX_HOPS];
+};
+
+static __thread uint32_t route_rand_state;
+
 struct route_entry {
+	packet_dest_t dest;
+
 	// time the route was last requested
 	mstime_t last_requested;
 
 	// time the route was last validated
 	mstime_t last_validated;
 
-	// the associated connection
-	connection_t *conn;
+	// time a packet was last broadcast to find faster paths
+	mstime_t last_probe;
+
+	// the next hops: set->conns[set->best] is the fastest, other hops
+	// validated recently and not much slower share the load
+	struct route_set *set;
+	struct route_hop hops[ROUTE_MAX_HOPS];
+
+	// RTTs of all acks for the destination, in microseconds
+	hist_t latency;
 };
 
-static struct route_entry routes[2];
+/** the route table */
+struct route_table {
+	epoch_entry_t epoch_entry;
+	unsigned int mask;
+	unsigned int count;
+	struct route_entry *slots[];
+};
+
+static struct route_table *route_table;
 static pthread_mutex_t route_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
-static int route_ok(int idx, mstime_t now)
+static inline unsigned int table_hash(packet_dest_t dest)
+{
+	return hash_64(dest);
+}
+
+/* finds the entry of a destination, lock free within an epoch read section */
+static struct route_entry *table_find(struct route_table *t, packet_dest_t dest)
+{
+	struct route_entry *entry;
+
+	if (!t)
+		return NULL;
+
+	for (unsigned int i = table_hash(dest) & t->mask; ; i = (i + 1) & t->mask) {
+		entry = atomic_load_acquire(&t->slots[i]);
+		if (!entry || entry->dest == dest)
+			return entry;
+	}
+}
+
+/* stores an entry in the first free slot, route_lock held */
+static void table_store(struct route_table *t, struct route_entry *entry)
+{
+	unsigned int i;
+
+	for (i = table_hash(entry->dest) & t->mask; t->slots[i]; i = (i + 1) & t->mask)
+		;
+
+	t->count++;
+	atomic_store_release(&t->slots[i], entry);
+}
+
+static void table_free(epoch_entry_t *entry)
 {
-	if (connection_ok(routes[idx].conn)) {
+	free(container_of(entry, struct route_table, epoch_entry));
+}
+
+/* adds an entry, rebuilding the table if needed, route_lock held */
+static int table_add(struct route_entry *entry)
+{
+	struct route_table *t = route_table, *newt;
+	unsigned int size;
+
+	// keep at least a quarter of the slots empty, probing stops there
+	if (t && (t->count + 1) * 4 <= (t->mask + 1) * 3) {
+		table_store(t, entry);
+		return 0;
+	}
+
+	size = t ? (t->mask + 1) * 2 : ROUTE_TABLE_MIN;
+	newt = calloc(1, sizeof(*newt) + size * sizeof(struct route_entry *));
+	if (!newt)
+		return -ENOMEM;
+	newt->mask = size - 1;
+
+	if (t) {
+		for (unsigned int i = 0; i <= t->mask; i++) {
+			if (t->slots[i])
+				table_store(newt, t->slots[i]);
+		}
+	}
+	table_store(newt, entry);
+
+	atomic_store_release(&route_table, newt);
+	if (t)
+		epoch_retire(&t->epoch_entry, table_free);
+
+	return 0;
+}
+
+/* checks if the route can be used */
+static int route_ok(struct route_entry *entry, connection_t *conn, mstime_t now)
+{
+	mstime_t validated = atomic_load_relaxed(&entry->last_validated);
+
+	if (connection_ok(conn)) {
 		// requested but not validated: ok if request is max. route_timeout seconds old
-		if (routes[idx].last_validated == 0)
-			return routes[idx].last_requested + route_timeout > now;
+		if (validated == 0)
+			return atomic_load_relaxed(&entry->last_requested) + route_timeout > now;
 		// requested and later validated
 		return 1;
 	}
 	return 0;
 }
 
+/* true value if it's time to broadcast a packet to find faster paths, for one thread */
+static int route_probe(struct route_entry *entry, mstime_t now)
+{
+	mstime_t last = atomic_load_relaxed(&entry->last_probe);
+
+	if (last + ROUTE_PROBE_INTERVAL > now)
+		return 0;
+	return atomic_cmpxchg_weak(&entry->last_probe, &last, now);
+}
+
+/* xorshift, per thread: good enough to pick hops */
+static inline uint32_t route_rand()
+{
+	uint32_t x = route_rand_state;
+
+	if (!x)
+		x = (uint32_t) time_monotonic_us() ^ (uint32_t) (uintptr_t) &route_rand_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	route_rand_state = x;
+	return x;
+}
+
+/* the cost of sending through a hop: the time until a packet gets through */
+static inline ustime_t hop_cost(connection_t *conn, ustime_t srtt)
+{
+	return (connection_output_count(conn) + 1) * (srtt + 1);
+}
+
+/* picks the hop for a packet among the usable ones, within an epoch read section */
+static connection_t *route_balance(struct route_entry *entry, struct route_set *set,
+	mstime_t now)
+{
+	connection_t *conns[ROUTE_MAX_HOPS];
+	ustime_t rtts[ROUTE_MAX_HOPS], limit;
+	struct route_hop *hop;
+	unsigned int num = 0, a, b;
+
+	hop = &entry->hops[set->best];
+	limit = ROUTE_MULTIPATH_STRETCH * atomic_load_relaxed(&hop->srtt) +
+		atomic_load_relaxed(&hop->rttvar);
+
+	for (unsigned int i = 0; i < ROUTE_MAX_HOPS; i++) {
+		hop = &entry->hops[i];
+		if (!connection_ok(set->conns[i]))
+			continue;
+
+		// the others must have been acked lately, a hop losing packets drops out
+		rtts[num] = atomic_load_relaxed(&hop->srtt);
+		if (i != set->best && (atomic_load_relaxed(&hop->last_ack) + route_timeout <= now ||
+			rtts[num] > limit))
+			continue;
+		conns[num++] = set->conns[i];
+	}
+
+	if (num == 0)
+		return NULL;
+	if (num == 1)
+		return conns[0];
+
+	// power of two choices
+	a = route_rand() % num;
+	b = (a + 1 + route_rand() % (num - 1)) % num;
+	return hop_cost(conns[a], rtts[a]) <= hop_cost(conns[b], rtts[b]) ? conns[a] : conns[b];
+}
+
 connection_t *route_get(packet_t *packet)
 {
 	connection_t *route = NULL; // NULL: broadcast
-	char dest = packet_get_dest(packet);
-	unsigned short id = packet_get_id(packet);
-	int idx = dest & 0x01;
-	mstime_t now = time_current();
+	struct route_entry *entry;
+	struct route_set *set;
+	packet_dest_t dest = packet_get_dest(packet);
+	mstime_t now = time_monotonic_ms(), validated;
 
-	// update the timestamp in the cache, used for health check
-	idcache_set_timestamp(dest, id);
+	epoch_enter();
 
-	pthread_mutex_lock(&route_lock);
+	// no entry: no ack came back for the destination yet
+	entry = table_find(atomic_load_acquire(&route_table), dest);
+	if (!entry)
+		goto out;
 
-	if (route_ok(idx, now)) {
-		route = routes[idx].conn;
-		connection_own(route);
+	// the ack of a broadcast comes back through the fastest path
+	set = atomic_load_acquire(&entry->set);
+	if (route_ok(entry, set->conns[set->best], now) && !route_probe(entry, now)) {
+		// the set owns the connections as long as it's visible
+		route = route_balance(entry, set, now);
+		if (route)
+			connection_own(route);
 	}
 
-	// update timestamps. only reset last_validate if not in the same 5 milliseconds
-	if (routes[idx].last_validated + 5 < now)
-		routes[idx].last_validated = 0;
-	if (routes[idx].last_requested + route_timeout < now)
-		routes[idx].last_requested = now;
-
-	pthread_mutex_unlock(&route_lock);
+	// update timestamps, only when they change. only reset last_validate if
+	// not in the same 5 milliseconds
+	validated = atomic_load_relaxed(&entry->last_validated);
+	if (validated && validated + 5 < now)
+		atomic_store_relaxed(&entry->last_validated, 0);
+	if (atomic_load_relaxed(&entry->last_requested) + route_timeout < now)
+		atomic_store_relaxed(&entry->last_requested, now);
 
+out:
+	epoch_exit();
 	return route;
 }
 
-void route_mark_alive(connection_t *conn, char dest, mstime_t time_sent)
+static void set_free(epoch_entry_t *entry)
+{
+	struct route_set *set = container_of(entry, struct route_set, epoch_entry);
+
+	for (unsigned int i = 0; i < ROUTE_MAX_HOPS; i++) {
+		if (set->conns[i])
+			connection_release(set->conns[i]);
+	}
+	free(set);
+}
+
+/*
+ * publishes a copy of the hop set with the connection of hop 'idx' replaced
+ * by conn (NULL to keep it) and the new best hop, route_lock held
+ */
+static int set_publish(struct route_entry *entry, unsigned int idx, connection_t *conn,
+	unsigned int best)
+{
+	struct route_set *old = entry->set, *set;
+
+	set = malloc(sizeof(*set));
+	if (!set)
+		return -ENOMEM;
+
+	memcpy(set->conns, old->conns, sizeof(set->conns));
+	if (conn)
+		set->conns[idx] = conn;
+	set->best = best;
+	for (unsigned int i = 0; i < ROUTE_MAX_HOPS; i++) {
+		if (set->conns[i])
+			connection_own(set->conns[i]);
+	}
+
+	atomic_store_release(&entry->set, set);
+	epoch_retire(&old->epoch_entry, set_free);
+	return 0;
+}
+
+/* adds an RTT sample to the estimate, route_lock held */
+static void hop_sample(struct route_hop *hop, ustime_t rtt)
+{
+	ustime_t err;
+
+	if (!hop->samples++) {
+		atomic_store_relaxed(&hop->srtt, rtt);
+		atomic_store_relaxed(&hop->rttvar, rtt / 2);
+		return;
+	}
+
+	err = rtt > hop->srtt ? rtt - hop->srtt : hop->srtt - rtt;
+	atomic_store_relaxed(&hop->rttvar, (3 * hop->rttvar + err) / 4);
+	atomic_store_relaxed(&hop->srtt, (7 * hop->srtt + rtt) / 8);
+}
+
+/* checks if hop 'idx' can be used, route_lock held */
+static int hop_live(struct route_entry *entry, unsigned int idx, mstime_t now)
+{
+	return connection_ok(entry->set->conns[idx]) && entry->hops[idx].last_ack + ROUTE_HOP_TTL > now;
+}
+
+/* finds the hop of a connection or sets up a new one, route_lock held */
+static int hop_get(struct route_entry *entry, connection_t *conn, mstime_t now)
+{
+	struct route_set *set = entry->set;
+	int victim = -1;
+
+	for (unsigned int i = 0; i < ROUTE_MAX_HOPS; i++) {
+		if (set->conns[i] == conn)
+			return i;
+
+		// replace an empty or dead hop, else the slowest one but the current
+		if (victim < 0 || hop_live(entry, victim, now)) {
+			if (!hop_live(entry, i, now) || (i != set->best &&
+				(victim < 0 || entry->hops[i].srtt > entry->hops[victim].srtt)))
+				victim = i;
+		}
+	}
+
+	if (set_publish(entry, victim, conn, set->best))
+		return -1;
+
+	entry->hops[victim].samples = 0;
+	return victim;
+}
+
+/* the fastest live hop, route_lock held */
+static unsigned int route_select(struct route_entry *entry, mstime_t now)
+{
+	unsigned int best = entry->set->best;
+
+	for (unsigned int i = 0; i < ROUTE_MAX_HOPS; i++) {
+		if (hop_live(entry, i, now) &&
+			(!hop_live(entry, best, now) || entry->hops[i].srtt < entry->hops[best].srtt))
+			best = i;
+	}
+	return best;
+}
+
+/* checks if a hop is faster than the current, by more than the hysteresis */
+static int hop_faster(struct route_hop *hop, struct route_hop *cur)
+{
+	ustime_t margin = cur->srtt / ROUTE_HYSTERESIS_DIV;
+
+	if (cur->rttvar > margin)
+		margin = cur->rttvar;
+	return hop->srtt + hop->rttvar + margin < cur->srtt;
+}
+
+/* creates the entry of a destination, route_lock held */
+static struct route_entry *entry_create(packet_dest_t dest, mstime_t now)
+{
+	struct route_entry *entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return NULL;
+
+	entry->set = calloc(1, sizeof(struct route_set));
+	if (!entry->set) {
+		free(entry);
+		return NULL;
+	}
+
+	entry->dest = dest;
+	entry->last_requested = now;
+	entry->last_probe = now;
+
+	if (table_add(entry)) {
+		free(entry->set);
+		free(entry);
+		return NULL;
+	}
+	return entry;
+}
+
+void route_mark_alive(connection_t *conn, packet_dest_t dest, ustime_t time_received)
 {
-	int idx = dest & 0x01;
-	mstime_t now = time_current();
+	struct route_entry *entry;
+	struct route_hop *hop, *cur;
+	unsigned int best;
+	int idx, had_route, changed;
+	ustime_t rtt = time_monotonic_us() - time_received;
+	mstime_t now = time_monotonic_ms();
 
 	char hoststr[INET_ADDRSTRLEN];
 	unsigned short port = connection_get_port(conn);
 	net_addr_str(connection_get_addr(conn), hoststr, sizeof(hoststr));
 
+	metrics_record(METRIC_HIST_ROUND_TRIP, rtt);
+
+	pthread_mutex_lock(&route_lock);
+
+	// the latency of the neighbor and of the destination, even if too slow
+	hist_record(&conn->latency, rtt);
+	entry = table_find(route_table, dest);
+	if (entry)
+		hist_record(&entry->latency, rtt);
+
 	// the route works, but is too slow?
-	if (now - time_sent > route_timeout) {
+	if (rtt > (ustime_t) route_timeout * 1000) {
 		dbg("Route alive, but too slow: %s:%hu\n", hoststr, port);
-		return;
+		goto out;
 	}
 
-	pthread_mutex_lock(&route_lock);
+	if (!entry) {
+		entry = entry_create(dest, now);
+		if (entry)
+			hist_record(&entry->latency, rtt);
+	}
+	had_route = entry && entry->set->conns[entry->set->best];
+	idx = entry ? hop_get(entry, conn, now) : -1;
+	if (idx < 0) {
+		dbg("Cannot allocate route for dest %u\n", dest);
+		goto out;
+	}
 
-	if (!route_ok(idx, now)) {
-		// new route found, set
-		if (routes[idx].conn != conn)
-			connection_release(conn);
-		connection_own(conn);
-		routes[idx].conn = conn;
-		routes[idx].last_validated = now;
+	hop = &entry->hops[idx];
+	hop_sample(hop, rtt);
+	atomic_store_relaxed(&hop->last_ack, now);
 
-		dbg("New route for dest %hhd: %s:%hu\n", dest, hoststr, port);
+	best = entry->set->best;
+	cur = &entry->hops[best];
+	if (!had_route || !route_ok(entry, entry->set->conns[best], now) ||
+	    !hop_live(entry, best, now)) {
+		// new route found, set: the fastest known
+		best = route_select(entry, now);
+		changed = !had_route || best != entry->set->best;
+		if (best != entry->set->best && set_publish(entry, 0, NULL, best))
+			goto out;
+		atomic_store_relaxed(&entry->last_validated, now);
 
-	} else if (routes[idx].conn == conn){
+		// re-validated after a timeout, the fastest is still the same
+		if (changed) {
+			metrics_inc(METRIC_ROUTE_CHANGES);
+			dbg("New route for dest %u: %s:%hu, RTT %llu us\n", dest, hoststr, port,
+				entry->hops[best].srtt);
+		} else {
+			dbg("Re-validate route for dest %u: %s:%hu, RTT %llu us\n", dest, hoststr,
+				port, entry->hops[best].srtt);
+		}
+
+	} else if (hop == cur) {
 		// route is the current, update timestamp
-		routes[idx].last_validated = now;
+		atomic_store_relaxed(&entry->last_validated, now);
+
+		dbg("Re-validate current route for dest %u: %s:%hu, RTT %llu us\n", dest, hoststr,
+			port, hop->srtt);
 
-		dbg("Re-validate current route for dest %hhd: %s:%hu\n", dest, hoststr, port);
+	} else if (hop_faster(hop, cur)) {
+		if (set_publish(entry, 0, NULL, idx))
+			goto out;
+		atomic_store_relaxed(&entry->last_validated, now);
+
+		metrics_inc(METRIC_ROUTE_CHANGES);
+		dbg("Faster route for dest %u: %s:%hu, RTT %llu us instead of %llu us\n", dest,
+			hoststr, port, hop->srtt, cur->srtt);
 	}
 
+out:
 	pthread_mutex_unlock(&route_lock);
 }
 
+void route_write_metrics(FILE *f)
+{
+	static const char *name = "meshy_route_rtt_microseconds";
+	struct route_table *t;
+	struct route_entry *entry;
+	char labels[32];
+	hist_t *h;
+
+	h = malloc(sizeof(*h));
+	if (!h)
+		return;
+
+	metrics_write_header(f, name, "Round trip time from receiving a packet to receiving its ack, per destination",
+		"summary");
+
+	epoch_enter();
+	t = atomic_load_acquire(&route_table);
+	for (unsigned int i = 0; t && i <= t->mask; i++) {
+		entry = atomic_load_acquire(&t->slots[i]);
+		if (!entry)
+			continue;
+
+		memset(h, 0, sizeof(*h));
+		hist_merge(h, &entry->latency);
+		snprintf(labels, sizeof(labels), "dest=\"%u\"", entry->dest);
+		metrics_write_summary(f, name, labels, h);
+	}
+	epoch_exit();
+
+	free(h);
+}
+
 void route_set_timeout(int timeout)
 {
 	route_timeout = timeout;
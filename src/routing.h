@@ -7,11 +7,13 @@
  * Written by Daniel Ritz
  */
 
+#include <stdio.h>
+
 #include "connection.h"
 #include "packet.h"
 
 /**
- * returns the route for the packet to send
+ * returns the route for the packet to send, lock free
  *   the connection must be connection_release()d
  * @param packet the packet to get the route for
  * @return the route for the given destination or null for broadcast.
@@ -20,16 +22,24 @@ connection_t *route_get(packet_t *packet);
 
 /**
  * mark a route alive for a connection and a given dest. called whenever an
- * 'O' packet is received from a connection
+ * 'O' packet is received from a connection. The round trip time is taken
+ * into account to prefer the fastest route, and recorded in the latency
+ * histograms of the destination and the connection.
  * @param conn the connection the 'O' packet was received from
  * @param dest the destination
- * @param time_sent the time the original packet was sent
+ * @param time_received the time the original packet was received, time_monotonic_us()
+ */
+void route_mark_alive(connection_t *conn, packet_dest_t dest, ustime_t time_received);
+
+/**
+ * writes the latency histograms of all destinations as metrics
+ * @param f the stream to write to
  */
-void route_mark_alive(connection_t *conn, char dest, mstime_t time_sent);
+void route_write_metrics(FILE *f);
 
 /**
  * sets the routing timeout
- * @param timeout the timeout in seconds
+ * @param timeout the timeout in milliseconds
  */
 void route_set_timeout(int timeout);
 
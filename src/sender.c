@@ -1,54 +1,179 @@
 /**
  * Sender thread
  *
+ * The sender threads form a pool: at least the minimum number of threads is
+ * always running. A thread seeing more packets queued than there are threads
+ * starts another one, up to the maximum. Threads above the minimum exit
+ * after idling for SENDER_IDLE_TIMEOUT, so the pool follows the load.
+ *
  * Written by Daniel Ritz
  */
 
+#ifdef HAVE_SCHED_AFFINITY
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <unistd.h>
 #include <pthread.h>
 
 #include "lib/utils.h"
 #include "lib/net.h"
+#include "lib/atomic.h"
 
 #include "sender.h"
 #include "sendq.h"
 #include "routing.h"
+#include "metrics.h"
+
+// pool limits, set by sender_initialize()
+static unsigned int sender_min;
+static unsigned int sender_max;
+
+// threads running and when the last one was started
+static unsigned int sender_running;
+static ustime_t sender_last_grow;
+
+// CPUs the senders are pinned to, none if empty
+static unsigned short sender_cpus[SENDER_MAX_CPUS];
+static unsigned int num_cpus;
+
+// slots taken by the running threads, one bit each. A thread is pinned by
+// its slot, the lowest free one, so exited threads leave no CPU unused
+#define BITS_PER_WORD		(8 * sizeof(unsigned long))
+static unsigned long *sender_slots;
+static pthread_mutex_t sender_slots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int sender_start();
 
 static void send_unicast(connection_t *conn, packet_t *packet)
 {
-	ssize_t len;
+	int err;
 	char hoststr[INET_ADDRSTRLEN];
 
-	len = connection_send_packet(conn, packet);
+	err = connection_send_packet(conn, packet);
 
-	if (len == PACKET_SIZE) {
-		dbg("Successfully sent packet with id %hd to %s:%hu\n",
-			packet_get_id(packet),
+	if (!err) {
+		dbg("Queued packet with id %llu to %s:%hu\n",
+			(unsigned long long) packet_get_id(packet),
 			net_addr_str(connection_get_addr(conn), hoststr, sizeof(hoststr)),
 			connection_get_port(conn));
 	} else {
-		dbg("Failed sending packet with id %hd to %s:%hu (%zd/%d bytes sent)\n",
-			packet_get_id(packet),
+		metrics_inc(METRIC_SEND_FAILURES);
+		dbg("Failed queueing packet with id %llu to %s:%hu (%d)\n",
+			(unsigned long long) packet_get_id(packet),
 			net_addr_str(connection_get_addr(conn), hoststr, sizeof(hoststr)),
-			connection_get_port(conn), len, PACKET_SIZE);
+			connection_get_port(conn), err);
 	}
 }
 
 static void send_broadcast(packet_t *packet, connection_t *origin)
 {
-	connection_t **array, **iter;
+	connection_snapshot_t *snap;
+
+	snap = connection_snapshot_get();
+	for (unsigned int i = 0; i < snap->count; i++) {
+		if (snap->conns[i] != origin)
+			send_unicast(snap->conns[i], packet);
+	}
+	connection_snapshot_put(snap);
+}
+
+#ifdef HAVE_SCHED_AFFINITY
+/* pins the calling thread to the CPU of its slot, if CPUs are set */
+static void sender_pin(unsigned int slot)
+{
+	cpu_set_t set;
+	int err;
+
+	if (!num_cpus)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(sender_cpus[slot % num_cpus], &set);
+	err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err)
+		dbg("Cannot pin sender thread %u to CPU %hu (%d)\n", slot, sender_cpus[slot % num_cpus], -err);
+	else
+		dbg("Sender thread %u pinned to CPU %hu\n", slot, sender_cpus[slot % num_cpus]);
+}
+#else
+static inline void sender_pin(unsigned int slot) { }
+#endif
+
+/* takes the lowest free slot, -EAGAIN if the pool is at its maximum */
+static int slot_get()
+{
+	int slot = -EAGAIN;
 
-	array = connection_get_array();
-	for (iter = array; *iter != NULL; iter++) {
-		connection_t *conn = *iter;
+	pthread_mutex_lock(&sender_slots_lock);
+	for (unsigned int i = 0; i < sender_max; i++) {
+		if (!(sender_slots[i / BITS_PER_WORD] & (1UL << (i % BITS_PER_WORD)))) {
+			sender_slots[i / BITS_PER_WORD] |= 1UL << (i % BITS_PER_WORD);
+			slot = i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sender_slots_lock);
+
+	return slot;
+}
+
+static void slot_put(unsigned int slot)
+{
+	pthread_mutex_lock(&sender_slots_lock);
+	sender_slots[slot / BITS_PER_WORD] &= ~(1UL << (slot % BITS_PER_WORD));
+	pthread_mutex_unlock(&sender_slots_lock);
+}
 
-		if (conn != origin)
-			send_unicast(conn, packet);
+/* gets a packet to send. Returns -ETIMEDOUT if the thread should exit */
+static int sender_get(packet_t **packet, connection_t **origin)
+{
+	unsigned int running;
 
-		connection_release(conn);
+	for (;;) {
+		running = atomic_load_relaxed(&sender_running);
+		if (running <= sender_min) {
+			sendq_get(packet, origin);
+			return 0;
+		}
+
+		if (!sendq_get_timeout(packet, origin, SENDER_IDLE_TIMEOUT * 1000))
+			return 0;
+
+		// idle for a while: exit, unless the pool shrank meanwhile
+		running = atomic_load_relaxed(&sender_running);
+		while (running > sender_min) {
+			if (atomic_cmpxchg_weak(&sender_running, &running, running - 1))
+				return -ETIMEDOUT;
+		}
 	}
-	free(array);
+}
+
+/* starts another thread if the senders don't keep up with the queue */
+static void sender_grow()
+{
+	unsigned int running = atomic_load_relaxed(&sender_running);
+	ustime_t now, last;
+
+	if (running >= sender_max || sendq_size() <= running)
+		return;
+
+	// one thread per interval, the new one needs a moment to take load
+	now = time_monotonic_us();
+	last = atomic_load_relaxed(&sender_last_grow);
+	if (now - last < SENDER_GROW_INTERVAL * 1000 ||
+	    !atomic_cmpxchg_weak(&sender_last_grow, &last, now))
+		return;
+
+	dbg("Send queue at %u packets, starting another sender thread\n", sendq_size());
+	sender_start();
 }
 
 static void *sender_thread(void *arg)
@@ -56,38 +181,159 @@ static void *sender_thread(void *arg)
 	packet_t *packet;
 	connection_t *origin;
 	connection_t *route;
+	unsigned int slot = (uintptr_t) arg;
+
+	sender_pin(slot);
 
 	for (;;) {
-		sendq_get(&packet, &origin);
+		if (sender_get(&packet, &origin)) {
+			dbg("Sender thread idle, exiting (%u left)\n", sender_count());
+			break;
+		}
+		sender_grow();
 
 		route = route_get(packet);
 		if (route != NULL) {
-			dbg("Unicast for packet ID %hd to %hhd\n",
-				packet_get_id(packet), packet_get_dest(packet));
+			metrics_inc(METRIC_UNICAST);
+			dbg("Unicast for packet ID %llu to %u\n",
+				(unsigned long long) packet_get_id(packet), packet_get_dest(packet));
 			send_unicast(route, packet);
 			connection_release(route);
 
 		} else {
-			dbg("Broadcast for packet ID %hd to %hhd\n",
-				packet_get_id(packet), packet_get_dest(packet));
+			metrics_inc(METRIC_BROADCAST);
+			dbg("Broadcast for packet ID %llu to %u\n",
+				(unsigned long long) packet_get_id(packet), packet_get_dest(packet));
 			send_broadcast(packet, origin);
 		}
 
 		connection_release(origin);
-		free(packet);
+		packet_put(packet);
 	}
 
+	slot_put(slot);
 	return NULL;
 }
 
-int sender_create()
+/* starts a sender thread, unless the pool is at its maximum */
+static int sender_start()
 {
-	int err;
+	int err, slot;
 	pthread_t thr;
 
-	err = pthread_create(&thr, NULL, sender_thread, NULL);
-	if (!err)
-		pthread_detach(thr);
+	// an exiting thread gives up its slot just after leaving the count, the
+	// pool grows again a moment later
+	slot = slot_get();
+	if (slot < 0)
+		return slot;
+	atomic_inc(&sender_running);
+
+	err = pthread_create(&thr, NULL, sender_thread, (void *) (uintptr_t) slot);
+	if (err) {
+		atomic_dec(&sender_running);
+		slot_put(slot);
+		return -err;
+	}
+
+	pthread_detach(thr);
+	return 0;
+}
+
+/* parses a CPU list like "0-3,8,10-11" */
+static int parse_cpus(const char *str)
+{
+	unsigned long first, last, cpu;
+	char *end;
+
+	num_cpus = 0;
+	for (;;) {
+		if (!isdigit(*str))
+			return -EINVAL;
+		first = last = strtoul(str, &end, 10);
+		if (*end == '-') {
+			str = end + 1;
+			if (!isdigit(*str))
+				return -EINVAL;
+			last = strtoul(str, &end, 10);
+		}
+		if (last < first || last >= SENDER_MAX_CPUS)
+			return -EINVAL;
+
+		for (cpu = first; cpu <= last && num_cpus < SENDER_MAX_CPUS; cpu++)
+			sender_cpus[num_cpus++] = cpu;
+
+		if (*end == '\0' || *end == '\n')
+			return 0;
+		if (*end != ',')
+			return -EINVAL;
+		str = end + 1;
+	}
+}
+
+int sender_set_cpus(const char *cpus)
+{
+#ifdef HAVE_SCHED_AFFINITY
+	char path[64];
+	char buf[4096];
+	unsigned int node;
+	FILE *f;
+	int err;
+
+	if (strncmp(cpus, "node", 4))
+		return parse_cpus(cpus);
+
+	// the CPUs of a NUMA node, from sysfs
+	if (!isdigit(cpus[4]))
+		return -EINVAL;
+	node = strtoul(cpus + 4, NULL, 10);
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
 
+	f = fopen(path, "r");
+	if (!f)
+		return errno == ENOENT ? -EINVAL : -errno;
+	err = fgets(buf, sizeof(buf), f) ? parse_cpus(buf) : -EIO;
+	fclose(f);
+
+	if (!err)
+		dbg("NUMA node %u has %u CPU(s)\n", node, num_cpus);
 	return err;
+#else
+	return -ENOSYS;
+#endif
+}
+
+int sender_initialize(unsigned int min, unsigned int max)
+{
+	unsigned int cpus;
+	int err;
+
+	// one thread per CPU used
+	cpus = num_cpus;
+	if (!cpus) {
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		cpus = online > 0 ? online : 1;
+	}
+
+	sender_min = min ? min : cpus;
+	sender_max = max ? max : cpus;
+	if (sender_max < sender_min)
+		sender_max = sender_min;
+
+	sender_slots = calloc((sender_max + BITS_PER_WORD - 1) / BITS_PER_WORD, sizeof(unsigned long));
+	if (!sender_slots)
+		return -ENOMEM;
+
+	dbg("Creating %u sender thread(s), up to %u\n", sender_min, sender_max);
+	for (unsigned int i = 0; i < sender_min; i++) {
+		err = sender_start();
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+unsigned int sender_count()
+{
+	return atomic_load_relaxed(&sender_running);
 }
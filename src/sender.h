@@ -2,16 +2,47 @@
 #define SENDER_H
 
 /**
- * Sender thread API
+ * Sender thread API - a pool of sender threads growing when the send queue
+ * fills up and shrinking again when threads are idle
  *
  * Written by Daniel Ritz
  */
 
+/** default number of sender threads always running */
+#define SENDER_DEFAULT_MIN		3
+
+/** max. number of CPUs sender threads can be pinned to */
+#define SENDER_MAX_CPUS			1024
+
+/** milliseconds a sender above the minimum may idle before it exits */
+#define SENDER_IDLE_TIMEOUT		1000
+
+/** milliseconds between starting two more sender threads */
+#define SENDER_GROW_INTERVAL	10
+
+/**
+ * restricts the sender threads to CPUs, each thread is pinned to one of them
+ * round robin. Must be called before sender_initialize().
+ * @param cpus a CPU list like "0-3,8,10-11" or "node<N>" for the CPUs of
+ * NUMA node N
+ * @return 0 on success, -EINVAL on an invalid list, -ENOSYS if pinning
+ * threads isn't supported, other error code (negative)
+ */
+int sender_set_cpus(const char *cpus);
+
+/**
+ * starts the sender threads
+ * @param min number of sender threads always running, 0 for one per CPU
+ * @param max upper limit of sender threads while the send queue fills up,
+ * 0 for one per CPU. Not less than min
+ * @return 0 on success, error code (negative) otherwise
+ */
+int sender_initialize(unsigned int min, unsigned int max);
 
 /**
- * creates a new sender thread
- * @return return value of pthread_create
+ * returns the number of sender threads running. Only a snapshot.
+ * @return number of sender threads
  */
-int sender_create();
+unsigned int sender_count();
 
 #endif
@@ -11,11 +11,13 @@
 #include <string.h>
 #include <errno.h>
 #include <poll.h>
+#include <sys/uio.h>
 
 #include "lib/net.h"
 #include "lib/utils.h"
 
 #include "packet.h"
+#include "loadgen.h"
 
 
 // response wait time in milli seconds
@@ -24,30 +26,258 @@
 static void usage()
 {
 	printf("Usage: \n");
-	printf("  sendmsg N <host> <port> <addhost> <addport>\n");
+	printf("  sendmsg [-2] N <host> <port> <addhost> <addport>\n");
 	printf("    sends an 'N' message with <addhost>:<addport> to meshy at <host>:<port>\n");
-	printf("  sendmsg C <host> <port> (q|z) <id> <msg>\n");
+	printf("  sendmsg [-2] C <host> <port> (q|z|<dest>) <id> <msg>\n");
 	printf("    sends an 'C' message towards dest 'q' or 'z' with <msg> to meshy at <host>:<port>\n");
-	printf("  sendmsg O <host> <port> (q|z) <id>\n");
+	printf("  sendmsg [-2] O <host> <port> (q|z|<dest>) <id>\n");
 	printf("    sends an 'O' message towards dest 'q' or 'z' to meshy at <host>:<port>\n");
+	printf("  sendmsg L [-1] [-r <rate>] [-w <window>] [-t <secs>] [-s <size>] [-T <ms>]\n");
+	printf("            (q|z|<dest>) <host> <port> [<host> <port>...]\n");
+	printf("    sends 'C' messages towards dest over one connection per meshy at <host>:<port>,\n");
+	printf("    matches the 'O' acks and prints throughput, loss and latency percentiles.\n");
+	printf("    Uses version 2 frames\n");
+	printf("    -1: use version 1 frames. Their 16 bit IDs repeat every 65536 messages, the\n");
+	printf("        nodes drop them as duplicates above some 50000 messages/s\n");
+	printf("    -r: open loop, <rate> messages per second over all connections,\n");
+	printf("        default is closed loop at max. throughput\n");
+	printf("    -w: max. messages in flight per connection, default %d\n", LOADGEN_DEFAULT_WINDOW);
+	printf("    -t: seconds to send messages, default 5\n");
+	printf("    -s: payload size in bytes, default 100\n");
+	printf("    -T: milliseconds until a message without ack is lost, default %d\n",
+		LOADGEN_DEFAULT_TIMEOUT);
+	printf("  -2: negotiate packet format version 2 first: 64 bit IDs, messages of any length\n");
+	printf("      and numeric destinations <dest> ('q' is 0, 'z' is 1)\n");
 	exit(1);
 }
 
+static packet_dest_t parse_dest(const char *str)
+{
+	if (!strcmp(str, "q"))
+		return 0;
+	if (!strcmp(str, "z"))
+		return 1;
+	return strtoul(str, NULL, 10);
+}
+
+/* waits for data with the response timeout, then reads len bytes */
+static ssize_t recv_wait(int fd, void *buf, size_t len)
+{
+	struct pollfd polldescr = {
+		.fd = fd,
+		.events = POLLIN,
+	};
+	ssize_t ret;
+	int err;
+
+	// first poll() to have a timeout
+	err = poll(&polldescr, 1, RESPONSE_WAIT_TIME);
+	if (err == 0)
+		return -ETIMEDOUT;
+	if (err == -1)
+		return -errno;
+
+	ret = recv(fd, buf, len, MSG_WAITALL);
+	if (ret == -1)
+		return -errno;
+	return ret;
+}
+
+/* sends a packet as frame of the given version */
+static int send_packet(int fd, packet_t *packet, int version)
+{
+	char hdr[PACKET_V2_HDR_SIZE];
+	struct iovec iov[2];
+	size_t total;
+	ssize_t len;
+
+	if (version < 2) {
+		iov[0].iov_base = packet->raw;
+		iov[0].iov_len = PACKET_SIZE;
+	} else {
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = packet_v2_header(packet, hdr);
+	}
+	iov[1].iov_base = packet_get_payload(packet);
+	iov[1].iov_len = version < 2 ? 0 : packet_get_len(packet);
+	total = iov[0].iov_len + iov[1].iov_len;
+
+	len = writev(fd, iov, 2);
+	if (len != (ssize_t) total) {
+		printf("packet incomplete, only %zd/%zu bytes sent\n", len, total);
+		return -EIO;
+	}
+	return 0;
+}
+
+/* receives a packet as frame of the given version, NULL on error */
+static packet_t *recv_packet(int fd, int version)
+{
+	char hdr[PACKET_V2_HDR_MAX];
+	struct packet_v2_hdr fields;
+	packet_t *packet;
+	ssize_t len;
+
+	if (version < 2) {
+		packet = packet_alloc();
+		if (!packet)
+			return NULL;
+		len = recv_wait(fd, packet->raw, PACKET_SIZE);
+		if (len != PACKET_SIZE)
+			goto out_err;
+		packet_parse_v1(packet);
+		return packet;
+	}
+
+	// the header starts with its length
+	len = recv_wait(fd, hdr, 1);
+	if (len != 1)
+		goto out_len;
+	len = recv_wait(fd, hdr + 1, (unsigned char) hdr[0] - 1);
+	if (len != (unsigned char) hdr[0] - 1)
+		goto out_len;
+	len = packet_v2_parse_header(hdr, &fields);
+	if (len)
+		goto out_len;
+
+	packet = packet_v2_alloc(&fields);
+	if (!packet)
+		return NULL;
+	len = fields.len ? recv_wait(fd, packet_get_payload(packet), fields.len) : 0;
+	if (len != (ssize_t) fields.len)
+		goto out_err;
+	return packet;
+
+out_err:
+	packet_put(packet);
+out_len:
+	if (len == -ETIMEDOUT)
+		printf("Timeout waiting for a response\n");
+	else if (len < 0)
+		check_error(len);
+	return NULL;
+}
+
+/* the load mode: options, dest and host/port pairs follow the 'L' */
+static int run_load(int argc, char *argv[])
+{
+	struct loadgen_config cfg;
+	struct loadgen_stats *stats;
+	struct sockaddr_in *hosts, *host;
+	unsigned int num_hosts;
+	double secs;
+	int opt, err;
+
+	loadgen_defaults(&cfg);
+	cfg.version = 2;
+
+	// the nodes remember IDs for a while, a run starts a million IDs per
+	// second after the last one. Version 1 frames carry only the low 16
+	// bits, those repeat every 65536 packets
+	cfg.first_id = (packet_id_t) time_current() * 1000;
+
+	while ((opt = getopt(argc, argv, "1r:w:t:s:T:")) != -1) {
+		switch (opt) {
+		case '1':
+			cfg.version = 1;
+			break;
+		case 'r':
+			cfg.rate = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			cfg.window = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			cfg.duration = atof(optarg) * 1000;
+			break;
+		case 's':
+			cfg.payload = strtoul(optarg, NULL, 10);
+			break;
+		case 'T':
+			cfg.timeout = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 3 || !(argc & 1))
+		usage();
+
+	cfg.dest = parse_dest(argv[0]);
+	num_hosts = argc / 2;
+	hosts = calloc(num_hosts, sizeof(*hosts));
+	stats = calloc(1, sizeof(*stats));
+	if (!hosts || !stats) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (unsigned int i = 0; i < num_hosts; i++) {
+		err = net_resolve(argv[1 + 2 * i], argv[2 + 2 * i], &host);
+		if (err) {
+			fprintf(stderr, "Unknown host/port: %s/%s\n", argv[1 + 2 * i], argv[2 + 2 * i]);
+			goto out;
+		}
+		hosts[i] = *host;
+		free(host);
+	}
+
+	if (cfg.rate)
+		printf("Sending %u messages/s for %.1f s over %u connection(s)\n",
+			cfg.rate, cfg.duration / 1000.0, num_hosts);
+	else
+		printf("Sending with %u messages in flight per connection for %.1f s over %u connection(s)\n",
+			cfg.window, cfg.duration / 1000.0, num_hosts);
+
+	err = loadgen_run(hosts, num_hosts, &cfg, stats);
+	if (check_error(err))
+		goto out;
+
+	secs = stats->elapsed / 1e6;
+	printf("Sent %lu, acked %lu, lost %lu (%.3f%%), unknown acks %lu\n",
+		stats->sent, stats->acked, stats->lost,
+		stats->sent ? 100.0 * stats->lost / stats->sent : 0.0, stats->unknown);
+	printf("Throughput %.0f messages/s over %.3f s\n", secs > 0 ? stats->acked / secs : 0.0, secs);
+	printf("Latency us: p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+		(unsigned long long) hist_quantile(&stats->latency, 0.5),
+		(unsigned long long) hist_quantile(&stats->latency, 0.9),
+		(unsigned long long) hist_quantile(&stats->latency, 0.99),
+		(unsigned long long) hist_quantile(&stats->latency, 0.999),
+		(unsigned long long) stats->latency.max);
+
+out:
+	free(stats);
+	free(hosts);
+	return err;
+}
+
 
 int main(int argc, char *argv[])
 {
 	struct sockaddr_in *host = NULL;
 	int err;
-	ssize_t len;
 	char cmd = 0;
 	char hoststr[INET_ADDRSTRLEN];
 	packet_t *packet = NULL;
 	int fd = 0;
 	int resp = 0;
+	int version = 1;
+	unsigned int max_payload;
+
+	if (argc > 1 && !strcmp(argv[1], "-2")) {
+		version = 2;
+		argc--;
+		argv++;
+	}
 
 	if (argc < 2)
 		usage();
 
+	if (!strcmp(argv[1], "L"))
+		return run_load(argc - 1, argv + 1) ? 1 : 0;
+
 	if (!strcmp(argv[1], "N")) {
 		if (argc != 6)
 			usage();
@@ -92,10 +322,14 @@ int main(int argc, char *argv[])
 		free(addhost);
 
 	} else if (cmd == 'C') {
-		char dest = !strcmp(argv[4], "z") ? 1 : 0;
-		unsigned short id = (short) atoi(argv[5]);
+		packet_dest_t dest = parse_dest(argv[4]);
 		char *cont = argv[6];
-		packet = packet_cre_content(id, dest, cont, strlen(cont));
+
+		// version 2: 64 bit IDs and the whole message
+		if (version < 2)
+			packet = packet_cre_content((unsigned short) atoi(argv[5]), dest, cont, strlen(cont));
+		else
+			packet = packet_cre_message(strtoull(argv[5], NULL, 10), dest, cont, strlen(cont));
 
 		printf("Sending 'C' packet to %s:%d\n",
 			net_addr_str(host, hoststr, sizeof(hoststr)), ntohs(host->sin_port));
@@ -103,11 +337,14 @@ int main(int argc, char *argv[])
 		resp = 1;
 
 	} else if (cmd == 'O') {
-		char dest = !strcmp(argv[4], "z") ? 1 : 0;
-		short id = (short) atoi(argv[5]);
+		packet_dest_t dest = parse_dest(argv[4]);
 		char *cont = "some ok packet";
-		packet = packet_cre_content(id, dest, cont, strlen(cont));
-		packet_set_type(packet, 'O');
+		packet = packet_cre_content(0, dest, cont, strlen(cont));
+		if (packet) {
+			packet_set_id(packet, version < 2 ? (unsigned short) atoi(argv[5]) :
+				strtoull(argv[5], NULL, 10));
+			packet_set_type(packet, 'O');
+		}
 
 		printf("Sending 'O' packet to %s:%d\n",
 			net_addr_str(host, hoststr, sizeof(hoststr)), ntohs(host->sin_port));
@@ -124,43 +361,31 @@ int main(int argc, char *argv[])
 		goto out_free;
 
 
-	len = write(fd, packet, PACKET_SIZE);
-	if (len == PACKET_SIZE) {
+	if (version >= 2) {
+		err = loadgen_negotiate_v2(fd, &max_payload);
+		if (!err)
+			printf("Switched to version 2, max. payload %u\n", max_payload);
+		else if (err == -EPROTO)
+			printf("Node doesn't support version 2\n");
+		else
+			check_error(err);
+		if (err)
+			goto out_close;
+	}
+
+	err = send_packet(fd, packet, version);
+	if (!err)
 		printf("packet sent\n");
-	} else {
-		printf("packet incomplete, only %zd/%d bytes sent\n", len, PACKET_SIZE);
-		err = -1;
+	else
 		resp = 0;
-	}
 
 	// await response?
 	if (resp) {
-		struct pollfd polldescr = {
-			.fd = fd,
-			.events = POLLIN,
-		};
-
-		packet_t *respacket = packet_alloc();
-		if (!respacket)
-			goto out_close;
-
-		// first poll() to have a timeout
-		err = poll(&polldescr, 1, RESPONSE_WAIT_TIME);
-		if (err == 0) {
-			printf("Timeout waiting for a response\n");
-		} else if (err == -1) {
-			check_error(-errno);
-
-		} else {
-			len = recv(fd, respacket, PACKET_SIZE, MSG_WAITALL);
-			if (len == -1) {
-			   check_error(-errno);
-			} else {
-				char dest = packet_get_dest(respacket);
-				unsigned short id = packet_get_id(respacket);
-
-				printf("Response receveived for ID: %hd to %hhd\n", id, dest);
-			}
+		packet_t *respacket = recv_packet(fd, version);
+		if (respacket) {
+			printf("Response receveived for ID: %llu to %u\n",
+				(unsigned long long) packet_get_id(respacket), packet_get_dest(respacket));
+			packet_put(respacket);
 		}
 	}
 
@@ -168,7 +393,7 @@ int main(int argc, char *argv[])
 out_close:
 	shutdown(fd, SHUT_RDWR);
 	close(fd);
-	free(packet);
+	packet_put(packet);
 out_free:
 	free(host);
 out:
@@ -1,73 +1,114 @@
 /**
  * Sender Queue
  *
+ * A bounded lock-free MPMC ring. Idle senders park on a wait queue, as do
+ * receivers if the queue is full. Only one thread is woken up per element.
+ *
  * Written by Daniel Ritz
  */
 
 #include <stdlib.h>
-#include <pthread.h>
 #include <errno.h>
 
-#include "lib/list.h"
+#include "lib/ring.h"
+#include "lib/waitq.h"
+#include "lib/utils.h"
 #include "connection.h"
 #include "sendq.h"
+#include "metrics.h"
 
 struct sendq_entry {
 	packet_t *packet;
 	connection_t *origin;
+	ustime_t queued;
 };
 
-#define SEND_QUEUE_SIZE	100
-
-static struct sendq_entry send_queue[SEND_QUEUE_SIZE];
-static pthread_mutex_t sendq_list_lock = PTHREAD_MUTEX_INITIALIZER;
-static int qpos_write;
-static int qpos_read;
-static int qsize;
+static ring_t send_queue;
+static waitq_t sendq_notfull;
+static waitq_t sendq_notempty;
 
-static pthread_cond_t sendq_cond_notfull = PTHREAD_COND_INITIALIZER;
-static pthread_cond_t sendq_cond_notempty = PTHREAD_COND_INITIALIZER;
+int sendq_initialize(unsigned int size)
+{
+	waitq_init(&sendq_notfull);
+	waitq_init(&sendq_notempty);
+	return ring_init(&send_queue, size, sizeof(struct sendq_entry));
+}
 
 int sendq_add(packet_t *packet, connection_t *origin)
 {
-	packet = packet_dup(packet);
-	if (!packet)
-		return -ENOMEM;
-
-	pthread_mutex_lock(&sendq_list_lock);
-	while (qsize == SEND_QUEUE_SIZE)
-		pthread_cond_wait(&sendq_cond_notfull, &sendq_list_lock);
+	struct sendq_entry entry;
+	unsigned int ticket;
 
+	packet_get(packet);
 	connection_own(origin);
-	send_queue[qpos_write].packet = packet;
-	send_queue[qpos_write].origin = origin;
+	entry.packet = packet;
+	entry.origin = origin;
+	entry.queued = time_monotonic_us();
 
-	qsize++;
-	qpos_write++;
-	if (qpos_write == SEND_QUEUE_SIZE)
-		qpos_write = 0;
+	while (ring_push(&send_queue, &entry)) {
+		ticket = waitq_prepare(&sendq_notfull);
+		if (!ring_push(&send_queue, &entry)) {
+			waitq_cancel(&sendq_notfull);
+			break;
+		}
+		waitq_wait(&sendq_notfull, ticket);
+	}
 
-	pthread_mutex_unlock(&sendq_list_lock);
-	pthread_cond_broadcast(&sendq_cond_notempty);
+	waitq_wake(&sendq_notempty, 0);
 
 	return 0;
 }
 
 void sendq_get(packet_t **packet, connection_t **origin)
 {
-	pthread_mutex_lock(&sendq_list_lock);
-
-	while (qsize == 0)
-		pthread_cond_wait(&sendq_cond_notempty, &sendq_list_lock);
-
-	*packet = send_queue[qpos_read].packet;
-	*origin = send_queue[qpos_read].origin;
+	struct sendq_entry entry;
+	unsigned int ticket;
+
+	while (ring_pop(&send_queue, &entry)) {
+		ticket = waitq_prepare(&sendq_notempty);
+		if (!ring_pop(&send_queue, &entry)) {
+			waitq_cancel(&sendq_notempty);
+			break;
+		}
+		waitq_wait(&sendq_notempty, ticket);
+	}
+
+	waitq_wake(&sendq_notfull, 0);
+	metrics_record(METRIC_HIST_SENDQ_WAIT, time_monotonic_us() - entry.queued);
+
+	*packet = entry.packet;
+	*origin = entry.origin;
+}
 
-	qsize--;
-	qpos_read++;
-	if (qpos_read == SEND_QUEUE_SIZE)
-		qpos_read = 0;
+int sendq_get_timeout(packet_t **packet, connection_t **origin, unsigned long usec)
+{
+	struct sendq_entry entry;
+	unsigned int ticket;
+	ustime_t now, deadline = time_monotonic_us() + usec;
+
+	while (ring_pop(&send_queue, &entry)) {
+		ticket = waitq_prepare(&sendq_notempty);
+		if (!ring_pop(&send_queue, &entry)) {
+			waitq_cancel(&sendq_notempty);
+			break;
+		}
+		now = time_monotonic_us();
+		if (now >= deadline) {
+			waitq_cancel(&sendq_notempty);
+			return -ETIMEDOUT;
+		}
+		waitq_wait_timeout(&sendq_notempty, ticket, deadline - now);
+	}
+
+	waitq_wake(&sendq_notfull, 0);
+	metrics_record(METRIC_HIST_SENDQ_WAIT, time_monotonic_us() - entry.queued);
+
+	*packet = entry.packet;
+	*origin = entry.origin;
+	return 0;
+}
 
-	pthread_mutex_unlock(&sendq_list_lock);
-	pthread_cond_broadcast(&sendq_cond_notfull);
+unsigned int sendq_size()
+{
+	return ring_count(&send_queue);
 }
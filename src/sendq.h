@@ -10,9 +10,19 @@
  * Written by Daniel Ritz
  */
 
+/** default number of entries in the queue, must be a power of two */
+#define SEND_QUEUE_SIZE		128
+
+/**
+ * initializes the sending queue
+ * @param size number of entries, must be a power of two
+ * @return 0 on success, error code (negative) otherwise
+ */
+int sendq_initialize(unsigned int size);
+
 /**
- * adds a new packet to the sending queue
- * @param packet the packet - this will be packet_dup()d
+ * adds a new packet to the sending queue, blocking while the queue is full
+ * @param packet the packet - a reference is taken, the packet must not be modified afterwards
  * @param origin the origination connection - will be connection_own()d
  * @return 0 on success
  */
@@ -20,9 +30,24 @@ int sendq_add(packet_t *packet, connection_t *origin);
 
 /**
  * Gets an element from the queue, blocking
- * @param packet pointer to packet_t * receving the packet
+ * @param packet pointer to packet_t * receving the packet - this must be packet_put()
  * @param conn pointer to connection_t * receving the connection - this must be connection_release()d
  */
 void sendq_get(packet_t **packet, connection_t **conn);
 
+/**
+ * Like sendq_get(), but gives up after a timeout
+ * @param packet pointer to packet_t * receving the packet - this must be packet_put()
+ * @param conn pointer to connection_t * receving the connection - this must be connection_release()d
+ * @param usec the timeout in microseconds
+ * @return 0 on success, -ETIMEDOUT if the queue stayed empty
+ */
+int sendq_get_timeout(packet_t **packet, connection_t **conn, unsigned long usec);
+
+/**
+ * returns the number of entries currently in the queue. Only a snapshot.
+ * @return number of entries
+ */
+unsigned int sendq_size();
+
 #endif
@@ -0,0 +1,726 @@
+/*
+ * io_uring transport
+ *
+ * A single thread drives one io_uring instance for all connections, using
+ * the raw syscalls (no liburing):
+ * - inbound connections: one multishot accept on the listening socket
+ * - receiving: one multishot recv per connection, picking packet sized
+ *   buffers from a provided buffer ring. A buffer holding exactly one version
+ *   1 packet (the normal case) is passed on as is, no copy. Otherwise, the
+ *   data is reassembled in the connection's partial packet, which includes
+ *   all version 2 frames.
+ * - sending: one IORING_OP_SENDMSG per batch of queued packets, only one in
+ *   flight per connection to keep the order. Kicks from other threads are
+ *   signaled with an eventfd polled by a multishot poll.
+ * - outbound connections: IORING_OP_CONNECT
+ *
+ * The loop thread owns one reference on each connection, released once the
+ * connection is closed and no operation is in flight anymore. Only then the
+ * socket is closed, before its number could be reused by an accept while
+ * prepared SQEs still refer to it.
+ *
+ * Written by agent
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+
+#include "lib/utils.h"
+#include "lib/net.h"
+#include "lib/atomic.h"
+
+#include "uring.h"
+#include "receiver.h"
+
+/** number of submission queue entries */
+#define URING_ENTRIES		1024
+
+/** number of provided receive buffers, a power of two */
+#define URING_BUFS			4096
+
+/** buffer group ID of the receive buffers */
+#define URING_BGID			1
+
+/* operations, encoded in the low bits of the user_data */
+enum uring_op {
+	op_recv = 1,
+	op_send = 2,
+	op_connect = 3,
+	op_accept = 4,
+	op_wakeup = 5,
+};
+#define URING_OP_MASK		7
+
+/** per connection state */
+struct uring_conn {
+	connection_t *conn;
+
+	// number of operations in flight
+	unsigned int ops;
+	int sending;
+
+	// the batch being sent
+	struct msghdr msg;
+	struct iovec iov[CONNECTION_TX_IOVS];
+};
+
+static struct {
+	int fd;
+
+	// submission queue
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sq_local_tail;
+	struct io_uring_sqe *sqes;
+
+	// completion queue
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	// provided receive buffers
+	struct io_uring_buf_ring *br;
+	unsigned short br_tail;
+	packet_t *bufs[URING_BUFS];
+
+	// kicks from other threads
+	int evfd;
+	pthread_mutex_t pending_lock;
+	list_head_t pending;
+	pthread_t thread;
+
+	int listenfd;
+} ring;
+
+static int uring_active;
+
+static inline int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned int to_submit,
+	unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static inline int sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+	unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static inline uint64_t uring_data(struct uring_conn *uc, enum uring_op op)
+{
+	return (uintptr_t) uc | op;
+}
+
+/* submits all queued SQEs, optionally waits for completions */
+static int uring_submit(unsigned int wait)
+{
+	unsigned int to_submit;
+	int ret;
+
+	atomic_store_release(ring.sq_tail, ring.sq_local_tail);
+	to_submit = ring.sq_local_tail - atomic_load_acquire(ring.sq_head);
+
+	do {
+		ret = sys_io_uring_enter(ring.fd, to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret == -1 && errno == EINTR);
+
+	return ret == -1 ? -errno : 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe()
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	// submission queue full: let the kernel consume it first
+	if (ring.sq_local_tail - atomic_load_acquire(ring.sq_head) >= ring.sq_entries)
+		uring_submit(0);
+
+	idx = ring.sq_local_tail & ring.sq_mask;
+	sqe = &ring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[idx] = idx;
+	ring.sq_local_tail++;
+
+	return sqe;
+}
+
+/* hands a receive buffer (back) to the kernel */
+static void uring_buf_add(packet_t *pkt, unsigned short bid)
+{
+	// don't touch resv, bufs[0].resv is the ring tail
+	struct io_uring_buf *buf = &ring.br->bufs[ring.br_tail & (URING_BUFS - 1)];
+
+	buf->addr = (uintptr_t) pkt->raw;
+	buf->len = PACKET_SIZE;
+	buf->bid = bid;
+	ring.bufs[bid] = pkt;
+
+	ring.br_tail++;
+	atomic_store_release(&ring.br->tail, ring.br_tail);
+}
+
+static void uring_prep_recv(struct uring_conn *uc)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = connection_get_fd(uc->conn);
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = uring_data(uc, op_recv);
+	uc->ops++;
+}
+
+static void uring_prep_accept()
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = ring.listenfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = uring_data(NULL, op_accept);
+}
+
+static void uring_prep_wakeup()
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = ring.evfd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = uring_data(NULL, op_wakeup);
+}
+
+/* starts sending the next batch, unless already sending */
+static void uring_send(struct uring_conn *uc)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int num;
+
+	if (uc->sending || !connection_ok(uc->conn))
+		return;
+
+	num = connection_tx_prepare(uc->conn, uc->iov);
+	if (!num)
+		return;
+
+	memset(&uc->msg, 0, sizeof(uc->msg));
+	uc->msg.msg_iov = uc->iov;
+	uc->msg.msg_iovlen = num;
+
+	sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = connection_get_fd(uc->conn);
+	sqe->addr = (uintptr_t) &uc->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->user_data = uring_data(uc, op_send);
+
+	uc->sending = 1;
+	uc->ops++;
+}
+
+static void uring_close(struct uring_conn *uc)
+{
+	char hoststr[INET_ADDRSTRLEN];
+
+	if (!connection_is_closed(uc->conn)) {
+		dbg("Destroying connection to %s:%hu\n",
+			net_addr_str(connection_get_addr(uc->conn), hoststr, sizeof(hoststr)),
+			connection_get_port(uc->conn));
+
+		// shutdown() terminates the operations in flight, the socket is
+		// closed after the last one
+		connection_close(uc->conn);
+	}
+}
+
+/* an operation completed: release the connection after the last one */
+static void uring_op_done(struct uring_conn *uc)
+{
+	uc->ops--;
+	if (uc->ops == 0 && connection_is_closed(uc->conn)) {
+		// an SQE prepared but not yet submitted still has the socket number,
+		// closing earlier let an accept reuse it for another peer
+		if (connection_get_fd(uc->conn) >= 0)
+			close(connection_get_fd(uc->conn));
+		connection_release(uc->conn);
+		free(uc);
+	}
+}
+
+static void uring_kick(connection_t *conn)
+{
+	uint64_t one = 1;
+	int was_empty;
+
+	// already scheduled, the send will pick up the new packet
+	if (atomic_xchg(&conn->kick_pending, 1))
+		return;
+
+	connection_own(conn);
+	pthread_mutex_lock(&ring.pending_lock);
+	was_empty = list_empty(&ring.pending);
+	list_add_tail(&conn->kick_entry, &ring.pending);
+	pthread_mutex_unlock(&ring.pending_lock);
+
+	// the loop thread itself runs the pending list after each batch of completions
+	if (was_empty && !pthread_equal(pthread_self(), ring.thread)) {
+		while (write(ring.evfd, &one, sizeof(one)) == -1 && errno == EINTR)
+			;
+	}
+}
+
+static void uring_run_pending()
+{
+	LIST_HEAD(work);
+	connection_t *conn, *tmp;
+
+	pthread_mutex_lock(&ring.pending_lock);
+	list_splice_init(&ring.pending, &work);
+	pthread_mutex_unlock(&ring.pending_lock);
+
+	list_for_each_entry_safe(conn, tmp, &work, kick_entry) {
+		list_remove(&conn->kick_entry);
+		atomic_xchg(&conn->kick_pending, 0);
+
+		// the uring_conn is gone once closed
+		if (!connection_is_closed(conn))
+			uring_send(conn->io_priv);
+
+		// reference taken by uring_kick()
+		connection_release(conn);
+	}
+}
+
+/* received data in a buffer: pass on the packet(s) */
+static int uring_recv_data(connection_t *conn, packet_t *buf, size_t len)
+{
+	// exactly one version 1 packet: no copy needed
+	if (conn->rx_version < 2 && conn->rxlen == 0 && len == PACKET_SIZE) {
+		packet_parse_v1(buf);
+		receiver_process(conn, buf);
+		return 0;
+	}
+
+	// packet boundaries don't match the buffer: reassemble
+	return receiver_input(conn, buf->raw, len);
+}
+
+static void uring_handle_recv(struct uring_conn *uc, struct io_uring_cqe *cqe)
+{
+	unsigned short bid;
+	packet_t *buf;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		buf = ring.bufs[bid];
+
+		if (cqe->res > 0 && !connection_is_closed(uc->conn) &&
+			uring_recv_data(uc->conn, buf, cqe->res))
+			uring_close(uc);
+
+		// a buffer passed on might be shared now, replace it
+		if (packet_is_shared(buf)) {
+			packet_put(buf);
+			buf = packet_alloc();
+		}
+		if (buf)
+			uring_buf_add(buf, bid);
+	}
+
+	if (cqe->flags & IORING_CQE_F_MORE)
+		return;
+
+	// multishot terminated: out of buffers is fine, anything else is EOF/error
+	if (cqe->res == -ENOBUFS && !connection_is_closed(uc->conn))
+		uring_prep_recv(uc);
+	else
+		uring_close(uc);
+
+	uring_op_done(uc);
+}
+
+static void uring_handle_send(struct uring_conn *uc, struct io_uring_cqe *cqe)
+{
+	uc->sending = 0;
+
+	if (cqe->res < 0) {
+		uring_close(uc);
+	} else {
+		connection_tx_done(uc->conn, cqe->res);
+		uring_send(uc);
+	}
+
+	uring_op_done(uc);
+}
+
+static void uring_handle_connect(struct uring_conn *uc, struct io_uring_cqe *cqe)
+{
+	char hoststr[INET_ADDRSTRLEN];
+	connection_t *conn = uc->conn;
+
+	net_addr_str(connection_get_addr(conn), hoststr, sizeof(hoststr));
+
+	if (cqe->res < 0) {
+		dbg("  Cannot connect to %s:%hu\n", hoststr, connection_get_port(conn));
+		uring_close(uc);
+	} else if (!connection_is_closed(conn)) {
+		connection_connect(conn, connection_get_fd(conn));
+		dbg("  Connected to %s:%hu\n", hoststr, connection_get_port(conn));
+		uring_prep_recv(uc);
+	}
+
+	uring_op_done(uc);
+}
+
+static void uring_handle_accept(struct io_uring_cqe *cqe)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	char hoststr[INET_ADDRSTRLEN];
+	connection_t *conn;
+	int fd = cqe->res;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		uring_prep_accept();
+
+	if (fd < 0) {
+		check_error(fd);
+		return;
+	}
+
+	if (getpeername(fd, (struct sockaddr *) &addr, &addrlen) == -1) {
+		close(fd);
+		return;
+	}
+
+	dbg("New inbound connection from %s:%hu\n",
+		net_addr_str(&addr, hoststr, sizeof(hoststr)), ntohs(addr.sin_port));
+
+	conn = connection_create(fd, &addr);
+	if (!conn) {
+		dbg("Cannot allocate connection...");
+		shutdown(fd, SHUT_RDWR);
+		close(fd);
+		return;
+	}
+
+	if (check_error(uring_add(conn))) {
+		connection_close(conn);
+		connection_release(conn);
+	}
+}
+
+static void uring_handle_wakeup(struct io_uring_cqe *cqe)
+{
+	uint64_t val;
+
+	while (read(ring.evfd, &val, sizeof(val)) == -1 && errno == EINTR)
+		;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		uring_prep_wakeup();
+}
+
+static void uring_handle(struct io_uring_cqe *cqe)
+{
+	struct uring_conn *uc = (struct uring_conn *) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+
+	switch (cqe->user_data & URING_OP_MASK) {
+	case op_recv:
+		uring_handle_recv(uc, cqe);
+		break;
+
+	case op_send:
+		uring_handle_send(uc, cqe);
+		break;
+
+	case op_connect:
+		uring_handle_connect(uc, cqe);
+		break;
+
+	case op_accept:
+		uring_handle_accept(cqe);
+		break;
+
+	case op_wakeup:
+		uring_handle_wakeup(cqe);
+		break;
+	}
+}
+
+/* processes all available completions */
+static void uring_reap()
+{
+	unsigned int head, tail;
+
+	head = *ring.cq_head;
+	tail = atomic_load_acquire(ring.cq_tail);
+
+	while (head != tail) {
+		uring_handle(&ring.cqes[head & ring.cq_mask]);
+		head++;
+
+		// free the CQ entries early, handlers may submit a lot
+		atomic_store_release(ring.cq_head, head);
+		if (head == tail)
+			tail = atomic_load_acquire(ring.cq_tail);
+	}
+}
+
+int uring_add(connection_t *conn)
+{
+	struct uring_conn *uc;
+	struct io_uring_sqe *sqe;
+	char hoststr[INET_ADDRSTRLEN];
+	int fd;
+
+	uc = calloc(1, sizeof(*uc));
+	if (!uc)
+		return -ENOMEM;
+	uc->conn = conn;
+
+	if (connection_unconnected(conn)) {
+		dbg("io_uring: trying to connect to %s:%hu\n",
+			net_addr_str(connection_get_addr(conn), hoststr, sizeof(hoststr)),
+			connection_get_port(conn));
+
+		fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (fd == -1) {
+			free(uc);
+			return -errno;
+		}
+		connection_connecting(conn, fd);
+		conn->io_closes_fd = 1;
+		connection_set_io(conn, uring_kick, uc);
+
+		sqe = uring_get_sqe();
+		sqe->opcode = IORING_OP_CONNECT;
+		sqe->fd = fd;
+		sqe->addr = (uintptr_t) connection_get_addr(conn);
+		sqe->off = sizeof(struct sockaddr_in);
+		sqe->user_data = uring_data(uc, op_connect);
+		uc->ops++;
+
+	} else {
+		// packets queued before are sent with the next kick
+		conn->io_closes_fd = 1;
+		connection_set_io(conn, uring_kick, uc);
+		uring_prep_recv(uc);
+		uring_send(uc);
+	}
+
+	return 0;
+}
+
+static int uring_setup()
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	size_t sq_size, cq_size;
+	char *sq_ptr, *cq_ptr;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = 4 * URING_ENTRIES;
+
+	ring.fd = sys_io_uring_setup(URING_ENTRIES, &p);
+	if (ring.fd == -1)
+		return -errno;
+
+	// one mmap() for both rings is needed, the features used are younger
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+		return -ENOSYS;
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_size > sq_size)
+		sq_size = cq_size;
+
+	sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring.fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED)
+		return -errno;
+	cq_ptr = sq_ptr;
+
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		return -errno;
+
+	ring.sq_head = (unsigned int *) (sq_ptr + p.sq_off.head);
+	ring.sq_tail = (unsigned int *) (sq_ptr + p.sq_off.tail);
+	ring.sq_array = (unsigned int *) (sq_ptr + p.sq_off.array);
+	ring.sq_mask = *(unsigned int *) (sq_ptr + p.sq_off.ring_mask);
+	ring.sq_entries = p.sq_entries;
+	ring.sq_local_tail = *ring.sq_tail;
+
+	ring.cq_head = (unsigned int *) (cq_ptr + p.cq_off.head);
+	ring.cq_tail = (unsigned int *) (cq_ptr + p.cq_off.tail);
+	ring.cq_mask = *(unsigned int *) (cq_ptr + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) (cq_ptr + p.cq_off.cqes);
+
+	// the provided buffer ring, filled with packet buffers
+	if (posix_memalign((void **) &ring.br, sysconf(_SC_PAGESIZE),
+			URING_BUFS * sizeof(struct io_uring_buf)))
+		return -ENOMEM;
+	memset(ring.br, 0, URING_BUFS * sizeof(struct io_uring_buf));
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t) ring.br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (sys_io_uring_register(ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+		return -errno;
+
+	for (unsigned int i = 0; i < URING_BUFS; i++) {
+		packet_t *pkt = packet_alloc();
+		if (!pkt)
+			return -ENOMEM;
+		uring_buf_add(pkt, i);
+	}
+
+	return 0;
+}
+
+/* consumes the next completion of the probe, a buffer goes back to the ring */
+static void uring_probe_cqe(int *res, unsigned int *flags)
+{
+	unsigned int head = *ring.cq_head;
+	struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+
+	*res = cqe->res;
+	*flags = cqe->flags;
+	if (cqe->flags & IORING_CQE_F_BUFFER)
+		uring_buf_add(ring.bufs[cqe->flags >> IORING_CQE_BUFFER_SHIFT],
+			cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	atomic_store_release(ring.cq_head, head + 1);
+}
+
+/*
+ * multishot recv is the youngest feature used (Linux 6.0): try it on a
+ * socketpair, old kernels fail with -EINVAL or terminate the multishot
+ */
+static int uring_probe()
+{
+	struct io_uring_sqe *sqe;
+	unsigned int flags;
+	int sv[2], res, ret, err;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+		return -errno;
+
+	// no op in the user data: should a completion of the probe ever
+	// reach uring_handle(), it's ignored
+	sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sv[0];
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = 0;
+
+	if (write(sv[1], "x", 1) != 1) {
+		err = -errno;
+		goto out;
+	}
+	err = uring_submit(1);
+	if (err)
+		goto out;
+
+	// first completion: data received, multishot still active
+	uring_probe_cqe(&res, &flags);
+	if (!(flags & IORING_CQE_F_MORE)) {
+		err = -ENOSYS;
+		goto out;
+	}
+	err = res == 1 ? 0 : -ENOSYS;
+
+	// terminate it: EOF
+	close(sv[1]);
+	sv[1] = -1;
+	ret = uring_submit(1);
+	if (ret)
+		err = ret;
+	else
+		uring_probe_cqe(&res, &flags);
+
+out:
+	close(sv[0]);
+	if (sv[1] != -1)
+		close(sv[1]);
+	return err;
+}
+
+int uring_initialize()
+{
+	int err;
+
+	pthread_mutex_init(&ring.pending_lock, NULL);
+	INIT_LIST_HEAD(&ring.pending);
+	ring.thread = pthread_self();
+
+	err = uring_setup();
+	if (err)
+		return err;
+
+	err = uring_probe();
+	if (err)
+		return err;
+
+	ring.evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring.evfd == -1)
+		return -errno;
+
+	uring_active = 1;
+	return 0;
+}
+
+int uring_enabled()
+{
+	return uring_active;
+}
+
+int uring_run(int listenfd)
+{
+	int err;
+
+	ring.thread = pthread_self();
+	ring.listenfd = listenfd;
+	uring_prep_accept();
+	uring_prep_wakeup();
+
+	for (;;) {
+		err = uring_submit(1);
+		if (err)
+			return err;
+
+		uring_reap();
+		uring_run_pending();
+	}
+
+	return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef URING_H
+#define URING_H
+
+/**
+ * io_uring transport: receive, send and accept without a syscall per packet
+ *
+ * Written by agent
+ */
+
+#include <errno.h>
+
+#include "connection.h"
+
+#ifdef HAVE_IO_URING
+
+/**
+ * sets up the io_uring instance. Checks that the kernel supports everything
+ * needed (provided buffer rings, multishot accept and receive).
+ * @return 0 on success, error code (negative) if io_uring can't be used
+ */
+int uring_initialize();
+
+/**
+ * checks if the io_uring transport is used
+ * @return true value if initialized
+ */
+int uring_enabled();
+
+/**
+ * adds a connection to the io_uring transport. Takes over the ownership of
+ * the caller like evloop_add(). Must be called from the io_uring thread, i.e.
+ * while processing a packet.
+ * @param conn the connection
+ * @return 0 on success, error code (negative) otherwise
+ */
+int uring_add(connection_t *conn);
+
+/**
+ * runs the io_uring loop in the calling thread, accepting connections on
+ * the listening socket. Only returns on a fatal error.
+ * @param listenfd the listening socket
+ * @return error code (negative)
+ */
+int uring_run(int listenfd);
+
+#else
+
+static inline int uring_initialize()
+{
+	return -ENOSYS;
+}
+
+static inline int uring_enabled()
+{
+	return 0;
+}
+
+static inline int uring_add(connection_t *conn)
+{
+	return -ENOSYS;
+}
+
+static inline int uring_run(int listenfd)
+{
+	return -ENOSYS;
+}
+
+#endif
+
+#endif